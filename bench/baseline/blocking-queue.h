@@ -0,0 +1,95 @@
+#pragma once
+
+#include <QQueue>
+#include <QReadWriteLock>
+#include <QSemaphore>
+
+
+namespace qtstorage {
+namespace baseline {
+
+// BlockingQueue as it was before the ring buffer and the single-lock
+// core: a read-write lock around the items plus a semaphore per side.
+// Kept only so the benchmarks can run it next to the current queues
+template <class T>
+class BlockingQueue {
+public:
+    inline BlockingQueue() = default;
+    inline explicit BlockingQueue(int capacity);
+
+    inline bool enqueue(const T & item, qint64 timeout = -1);
+    inline bool tryEnqueue(const T & item);
+    inline T dequeue(qint64 timeout = -1, bool * ok = nullptr);
+    inline int size() const;
+    inline int capacity() const;
+
+private:
+    QQueue<T> items;
+    QSemaphore semaphore;
+    mutable QReadWriteLock mtx;
+
+    // Bounded mode only: enqueue() waits for a free slot, 0 means unbounded
+    const int limit = 0;
+    QSemaphore freeSlots;
+};
+
+template<class T>
+BlockingQueue<T>::BlockingQueue(int capacity) :
+    limit(qMax(capacity, 0)),
+    freeSlots(qMax(capacity, 0))
+{}
+
+template<class T>
+bool BlockingQueue<T>::enqueue(const T & item, qint64 timeout)
+{
+    if (limit > 0 && !freeSlots.tryAcquire(1, int(timeout))) {
+        return false;
+    }
+
+    QWriteLocker locker(&mtx);
+    items.enqueue(item);
+
+    semaphore.release(1);
+    return true;
+}
+
+template<class T>
+bool BlockingQueue<T>::tryEnqueue(const T & item)
+{
+    return enqueue(item, 0);
+}
+
+template<class T>
+T BlockingQueue<T>::dequeue(qint64 timeout, bool * ok)
+{
+    if (!semaphore.tryAcquire(1, int(timeout))) {
+        if (ok) { *ok = false; }
+        return T();
+    }
+
+    QWriteLocker locker(&mtx);
+    if (ok) { *ok = true; }
+    T item = items.dequeue();
+    locker.unlock();
+
+    if (limit > 0) {
+        freeSlots.release(1);
+    }
+    return item;
+}
+
+template<class T>
+int BlockingQueue<T>::size() const
+{
+    QReadLocker locker(&mtx);
+    return items.size();
+}
+
+template<class T>
+int BlockingQueue<T>::capacity() const
+{
+    return limit;
+}
+
+}
+}
@@ -0,0 +1,90 @@
+#include <QElapsedTimer>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include "baseline/blocking-queue.h"
+#include "blocking-queue.h"
+#include "ring-blocking-queue.h"
+
+using namespace qtstorage;
+
+
+namespace {
+
+constexpr int Capacity = 1024;
+
+struct Result {
+    double nsPerItem;
+    bool complete;
+};
+
+// Producers split the items evenly, so do consumers, every item is
+// checked to arrive exactly once by summing them up
+template<class Queue>
+Result run(int producers, int consumers, int items)
+{
+    Queue queue(Capacity);
+    std::vector<long long> sums(size_t(consumers), 0);
+    std::vector<std::thread> threads;
+
+    QElapsedTimer timer;
+    timer.start();
+
+    for (int p = 0; p < producers; ++p) {
+        threads.emplace_back([&queue, p, producers, items]() {
+            for (int i = p; i < items; i += producers) {
+                queue.enqueue(i);
+            }
+        });
+    }
+    for (int c = 0; c < consumers; ++c) {
+        threads.emplace_back([&queue, &sums, c, consumers, items]() {
+            for (int i = c; i < items; i += consumers) {
+                sums[size_t(c)] += queue.dequeue();
+            }
+        });
+    }
+    for (auto & thread : threads) {
+        thread.join();
+    }
+
+    const qint64 elapsed = timer.nsecsElapsed();
+
+    long long total = 0;
+    for (const long long sum : sums) {
+        total += sum;
+    }
+    return Result{double(elapsed) / items, total == (long long)(items) * (items - 1) / 2};
+}
+
+}
+
+
+int main(int argc, char ** argv)
+{
+    const int items = (argc > 1) ? std::atoi(argv[1]) : 2000000;
+    const int shapes[][2] = {{1, 1}, {2, 2}, {4, 4}, {1, 4}, {4, 1}, {8, 8}};
+
+    std::printf("%d items, capacity %d, hardware threads %u\n",
+                items, Capacity, std::thread::hardware_concurrency());
+    std::printf("%-10s %18s %18s %18s\n", "prod/cons", "baseline", "BlockingQueue", "RingBlockingQueue");
+
+    bool complete = true;
+    for (const auto & shape : shapes) {
+        const Result legacy = run<baseline::BlockingQueue<int>>(shape[0], shape[1], items);
+        const Result locking = run<BlockingQueue<int>>(shape[0], shape[1], items);
+        const Result ring = run<RingBlockingQueue<int>>(shape[0], shape[1], items);
+        complete = complete && legacy.complete && locking.complete && ring.complete;
+
+        std::printf("%4d/%-5d %13.1f ns/op %13.1f ns/op %13.1f ns/op\n",
+                    shape[0], shape[1], legacy.nsPerItem, locking.nsPerItem, ring.nsPerItem);
+    }
+
+    if (!complete) {
+        std::printf("items were lost or duplicated\n");
+        return 1;
+    }
+    return 0;
+}
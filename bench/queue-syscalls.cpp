@@ -0,0 +1,171 @@
+#include <QElapsedTimer>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "baseline/blocking-queue.h"
+#include "blocking-queue.h"
+
+using namespace qtstorage;
+
+
+namespace {
+
+// Counts an event over this process and every thread it starts while
+// the counter is open, -1 where perf events aren't permitted
+class Counter {
+public:
+    Counter(quint32 type, quint64 config) {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.inherit = 1;
+        fd = int(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+    ~Counter() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    void start() {
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+    long long stop() {
+        long long value = -1;
+        if (fd < 0) {
+            return value;
+        }
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &value, sizeof(value)) != sizeof(value)) {
+            value = -1;
+        }
+        return value;
+    }
+
+private:
+    int fd = -1;
+};
+
+// Syscall entries are a tracepoint, its id comes from tracefs
+qint64 syscallTracepoint()
+{
+    const char * paths[] = {"/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+                            "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id"};
+    for (const char * path : paths) {
+        if (FILE * file = std::fopen(path, "r")) {
+            long long id = -1;
+            const bool parsed = (std::fscanf(file, "%lld", &id) == 1);
+            std::fclose(file);
+            if (parsed) {
+                return id;
+            }
+        }
+    }
+    return -1;
+}
+
+struct Scenario {
+    const char * name;
+    int producers;
+    int consumers;
+    int capacity;
+};
+
+template<class Queue>
+void run(const char * queueName, const Scenario & scenario, int items, qint64 tracepoint)
+{
+    // Counters go first, they only follow threads started after them
+    Counter syscalls(PERF_TYPE_TRACEPOINT, quint64(qMax<qint64>(tracepoint, 0)));
+    Counter switches(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES);
+
+    Queue queue(scenario.capacity);
+    std::vector<std::thread> threads;
+
+    QElapsedTimer timer;
+    timer.start();
+    if (tracepoint >= 0) {
+        syscalls.start();
+    }
+    switches.start();
+
+    if (scenario.producers == 0) {
+        // Single thread, nobody is ever waiting
+        for (int i = 0; i < items; ++i) {
+            queue.enqueue(i);
+            queue.dequeue();
+        }
+    } else {
+        for (int p = 0; p < scenario.producers; ++p) {
+            threads.emplace_back([&queue, p, &scenario, items]() {
+                for (int i = p; i < items; i += scenario.producers) {
+                    queue.enqueue(i);
+                }
+            });
+        }
+        for (int c = 0; c < scenario.consumers; ++c) {
+            threads.emplace_back([&queue, c, &scenario, items]() {
+                for (int i = c; i < items; i += scenario.consumers) {
+                    queue.dequeue();
+                }
+            });
+        }
+        for (auto & thread : threads) {
+            thread.join();
+        }
+    }
+
+    const long long switchCount = switches.stop();
+    const long long syscallCount = (tracepoint >= 0) ? syscalls.stop() : -1;
+    const double nsPerItem = double(timer.nsecsElapsed()) / items;
+
+    // Starting and joining threads costs a few syscalls of its own,
+    // spread over a million items they don't show
+    std::printf("%-10s %-22s %12.3f %12.3f %10.1f\n",
+                queueName,
+                scenario.name,
+                (syscallCount < 0) ? -1.0 : double(syscallCount) / items,
+                (switchCount < 0) ? -1.0 : double(switchCount) / items,
+                nsPerItem);
+}
+
+}
+
+
+int main(int argc, char ** argv)
+{
+    const int items = (argc > 1) ? std::atoi(argv[1]) : 1000000;
+    const qint64 tracepoint = syscallTracepoint();
+
+    if (tracepoint < 0) {
+        std::printf("tracefs not mounted, syscalls are reported as -1\n");
+    }
+    std::printf("%d items, hardware threads %u\n", items, std::thread::hardware_concurrency());
+    std::printf("%-10s %-22s %12s %12s %10s\n", "queue", "scenario", "syscalls", "switches", "ns/item");
+
+    const Scenario scenarios[] = {
+        {"uncontended",          0, 0,    0},
+        {"1/1 unbounded",        1, 1,    0},
+        {"1/1 capacity 64",      1, 1,   64},
+        {"4/4 capacity 64",      4, 4,   64},
+        {"4/4 capacity 1024",    4, 4, 1024},
+    };
+    for (const auto & scenario : scenarios) {
+        run<baseline::BlockingQueue<int>>("baseline", scenario, items, tracepoint);
+        run<BlockingQueue<int>>("current", scenario, items, tracepoint);
+    }
+    return 0;
+}
@@ -1,52 +1,671 @@
 #pragma once
 
-#include <QQueue>
-#include <QReadWriteLock>
-#include <QSemaphore>
+#include <QElapsedTimer>
+#include <QList>
+#include <QMutex>
+#include <QWaitCondition>
+#include <atomic>
+#include <climits>
+#include <deque>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "detail/wait.h"
 
 
 namespace qtstorage {
 
+// What enqueue() does when a bounded queue is full
+enum class OverflowPolicy {
+    Block,          // wait for a free slot
+    DropNewest,     // discard the new item, the enqueue still succeeds
+    DropOldest,     // discard the item at the head to make room
+    Reject          // discard the new item and fail the enqueue
+};
+
+struct BlockingQueueStats {
+    quint64 expired = 0;
+    quint64 dropped = 0;
+    quint64 rejected = 0;
+};
+
 template <class T>
 class BlockingQueue {
 public:
-    inline void enqueue(const T & item);
+    // Consumes the queue until it is closed and drained
+    class Iterator {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = T *;
+        using reference = T &;
+
+    public:
+        Iterator() = default;
+        explicit Iterator(BlockingQueue * source) : queue(source) { ++*this; }
+
+        T & operator*() { return *current; }
+        T * operator->() { return &*current; }
+
+        Iterator & operator++() {
+            current = queue->dequeueFor(-1);
+            if (!current) {
+                queue = nullptr;
+            }
+            return *this;
+        }
+
+        bool operator==(const Iterator & other) const { return queue == other.queue; }
+        bool operator!=(const Iterator & other) const { return queue != other.queue; }
+
+    private:
+        BlockingQueue * queue = nullptr;
+        std::optional<T> current;
+    };
+
+    using Handler = std::function<void(const T &)>;
+    using Stats = BlockingQueueStats;
+
+public:
+    inline BlockingQueue();
+    // Any policy but Block keeps producers of a full queue from waiting
+    inline explicit BlockingQueue(int capacity, OverflowPolicy onOverflow = OverflowPolicy::Block);
+
+    // A positive lifetime overrides the queue one for this item
+    inline bool enqueue(const T & item, qint64 timeout = -1, qint64 lifetimeMsec = 0);
+    inline bool enqueue(T && item, qint64 timeout = -1, qint64 lifetimeMsec = 0);
+    template<class... Args>
+    inline bool emplace(Args &&... args);
+    inline bool tryEnqueue(const T & item);
+    inline bool tryEnqueue(T && item);
+    template<class Range>
+    inline int enqueueMany(Range && range, qint64 timeout = -1);
+    inline int enqueueMany(QList<T> && batch, qint64 timeout = -1);
     inline T dequeue(qint64 timeout = -1, bool * ok = nullptr);
+    inline std::optional<T> dequeueFor(qint64 timeout);
+
+    // Never wait, and with a 0 timeout neither do dequeue(), dequeueFor()
+    // and drainTo(): an empty queue is reported without taking the mutex
+    inline std::optional<T> tryDequeue();
+    inline std::optional<T> peek() const;
+
+    // Qt containers need a copyable T, a move-only T drains into a
+    // std::vector or std::deque through drainTo() instead
+    inline QList<T> dequeueMany(int maxItems, qint64 timeout = -1);
+    template<class Container>
+    inline int drainTo(Container & container, int maxItems = INT_MAX, qint64 timeout = -1);
     inline int size() const;
+    inline int capacity() const;
+    inline OverflowPolicy overflowPolicy() const;
+    inline Stats stats() const;
+
+    inline void setSpinLimit(int iterations);
+    inline int spinLimit() const;
+
+    // Items still queued after their lifetime are dropped by consumers
+    // instead of being handed out, 0 means they never go stale
+    inline void setItemLifetime(qint64 lifetimeMsec);
+    inline qint64 itemLifetime() const;
+    inline void installExpirationHandler(Handler handler);
+    inline quint64 expiredCount() const;
+
+    inline void close();
+    inline bool isClosed() const;
+
+    inline Iterator begin();
+    inline Iterator end();
 
 private:
-    QQueue<T> items;
-    QSemaphore semaphore;
-    QReadWriteLock mtx;
+    struct Slot {
+        T item;
+        qint64 expires;
+    };
+
+    template<class... Args>
+    inline bool put(qint64 timeout, qint64 lifetimeMsec, Args &&... args);
+    template<class Input>
+    inline int enqueueRange(Input first, Input last, qint64 timeout);
+    inline T takeFirst();
+    inline bool overflow();
+
+    inline qint64 deadline(qint64 lifetimeMsec);
+    inline void dropExpired(std::vector<T> & expired);
+    // Any locker type, QMutexLocker is a template on Qt 6
+    template<class Locker>
+    inline void report(Locker & locker, const std::vector<T> & expired);
+
+    inline void wake(QWaitCondition & condition, int waiters, int count);
+    inline int freeSlots() const;
+    inline bool drained() const;
+
+    // Called and returns with the mutex held, drops it while spinning
+    inline void spin(qint64 timeout);
+    static inline void relax();
+
+private:
+    std::deque<Slot> items;
+
+    // One mutex guards everything, a thread only touches a condition
+    // variable when the counters say somebody is actually sleeping on it
+    mutable QMutex mtx;
+    QWaitCondition notEmpty;
+    QWaitCondition notFull;
+    int waitingConsumers = 0;
+    int waitingProducers = 0;
+
+    // Closed: enqueues fail, dequeues drain what is left and then fail
+    bool closed = false;
+
+    // Bounded mode only: enqueue() waits for a free slot or applies the
+    // overflow policy, 0 means unbounded
+    const int limit = 0;
+    const OverflowPolicy policy = OverflowPolicy::Block;
+    Stats counters;
+
+    // Mirrors the item count so polling an empty queue needs no lock, a
+    // consumer finding it empty also spins on it for a while before
+    // sleeping, the budget grows while that pays off and shrinks when not
+    std::atomic<int> available{0};
+    std::atomic<int> maxSpin{0};
+    std::atomic<int> spinBudget{0};
+
+    // Staleness is only checked while some queued item can go stale
+    QElapsedTimer clock;
+    qint64 lifetime = 0;
+    int expiringItems = 0;
+    Handler expirationHandler = nullptr;
 };
 
 template<class T>
-void BlockingQueue<T>::enqueue(const T & item)
+BlockingQueue<T>::BlockingQueue() :
+    BlockingQueue(0)
+{}
+
+template<class T>
+BlockingQueue<T>::BlockingQueue(int capacity, OverflowPolicy onOverflow) :
+    limit(qMax(capacity, 0)),
+    policy(onOverflow)
+{
+    clock.start();
+}
+
+template<class T>
+bool BlockingQueue<T>::enqueue(const T & item, qint64 timeout, qint64 lifetimeMsec)
 {
-    QWriteLocker locker(&mtx);
-    items.enqueue(item);
+    return put(timeout, lifetimeMsec, item);
+}
+
+template<class T>
+bool BlockingQueue<T>::enqueue(T && item, qint64 timeout, qint64 lifetimeMsec)
+{
+    return put(timeout, lifetimeMsec, std::move(item));
+}
+
+template<class T>
+template<class... Args>
+bool BlockingQueue<T>::emplace(Args &&... args)
+{
+    return put(-1, 0, std::forward<Args>(args)...);
+}
+
+template<class T>
+bool BlockingQueue<T>::tryEnqueue(const T & item)
+{
+    return put(0, 0, item);
+}
+
+template<class T>
+bool BlockingQueue<T>::tryEnqueue(T && item)
+{
+    return put(0, 0, std::move(item));
+}
+
+template<class T>
+template<class... Args>
+bool BlockingQueue<T>::put(qint64 timeout, qint64 lifetimeMsec, Args &&... args)
+{
+    QMutexLocker locker(&mtx);
+    if (policy != OverflowPolicy::Block && !closed && freeSlots() <= 0) {
+        if (!overflow()) {
+            return (policy == OverflowPolicy::DropNewest);
+        }
+    } else if (!detail::waitUntil(mtx, notFull, waitingProducers, timeout, [this]() -> bool { return closed || freeSlots() > 0; })
+            || closed) {
+        return false;
+    }
 
-    semaphore.release(1);
+    items.push_back(Slot{T(std::forward<Args>(args)...), deadline(lifetimeMsec)});
+    available.store(int(items.size()), std::memory_order_release);
+    wake(notEmpty, waitingConsumers, 1);
+    return true;
+}
+
+template<class T>
+template<class Range>
+int BlockingQueue<T>::enqueueMany(Range && range, qint64 timeout)
+{
+    // Items of a range passed as an rvalue are moved into the queue
+    if constexpr (std::is_rvalue_reference<Range &&>::value) {
+        return enqueueRange(std::make_move_iterator(std::begin(range)),
+                            std::make_move_iterator(std::end(range)),
+                            timeout);
+    } else {
+        return enqueueRange(std::begin(range), std::end(range), timeout);
+    }
+}
+
+template<class T>
+int BlockingQueue<T>::enqueueMany(QList<T> && batch, qint64 timeout)
+{
+    return enqueueRange(std::make_move_iterator(batch.begin()),
+                        std::make_move_iterator(batch.end()),
+                        timeout);
+}
+
+template<class T>
+template<class Input>
+int BlockingQueue<T>::enqueueRange(Input first, Input last, qint64 timeout)
+{
+    const int total = int(std::distance(first, last));
+
+    if (policy != OverflowPolicy::Block) {
+        QMutexLocker locker(&mtx);
+        if (closed) {
+            return 0;
+        }
+
+        // Never waits, each item that doesn't fit goes by the policy
+        int queued = 0;
+        int accepted = 0;
+        for (; first != last; ++first) {
+            if (freeSlots() <= 0 && !overflow()) {
+                accepted += (policy == OverflowPolicy::DropNewest) ? 1 : 0;
+                continue;
+            }
+
+            items.push_back(Slot{T(*first), deadline(0)});
+            ++queued;
+            ++accepted;
+        }
+        available.store(int(items.size()), std::memory_order_release);
+
+        wake(notEmpty, waitingConsumers, queued);
+        return accepted;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+
+    // Bounded: items go in chunks of whatever slots are free, waiting
+    // only while not a single slot is
+    QMutexLocker locker(&mtx);
+    int done = 0;
+    while (done < total) {
+        const qint64 remaining = (timeout < 0) ? -1 : qMax<qint64>(0, timeout - timer.elapsed());
+        if (!detail::waitUntil(mtx, notFull, waitingProducers, remaining, [this]() -> bool { return closed || freeSlots() > 0; })
+                || closed) {
+            break;
+        }
+
+        const int chunk = qMin(total - done, freeSlots());
+        for (int i = 0; i < chunk; ++i, ++first) {
+            items.push_back(Slot{T(*first), deadline(0)});
+        }
+        available.store(int(items.size()), std::memory_order_release);
+
+        wake(notEmpty, waitingConsumers, chunk);
+        done += chunk;
+    }
+
+    return done;
 }
 
 template<class T>
 T BlockingQueue<T>::dequeue(qint64 timeout, bool * ok)
 {
-    if (!semaphore.tryAcquire(1, int(timeout))) {
-        if (ok) { *ok = false; }
-        return T();
+    return detail::unwrap(dequeueFor(timeout), ok);
+}
+
+template<class T>
+std::optional<T> BlockingQueue<T>::dequeueFor(qint64 timeout)
+{
+    if (timeout == 0) {
+        return tryDequeue();
+    }
+
+    QMutexLocker locker(&mtx);
+    spin(timeout);
+
+    // Stale items are dropped as they show up and don't end the wait
+    std::vector<T> expired;
+    std::optional<T> item;
+    if (detail::waitUntil(mtx, notEmpty, waitingConsumers, timeout,
+                          [&]() -> bool { dropExpired(expired); return closed || !items.empty(); })
+            && !items.empty()) {
+        item = takeFirst();
+    }
+
+    wake(notFull, waitingProducers, int(item.has_value()) + int(expired.size()));
+    report(locker, expired);
+    return item;
+}
+
+template<class T>
+std::optional<T> BlockingQueue<T>::tryDequeue()
+{
+    if (drained()) {
+        return std::nullopt;
     }
 
-    QWriteLocker locker(&mtx);
-    if (ok) { *ok = true; }
-    return items.dequeue();
+    QMutexLocker locker(&mtx);
+    std::vector<T> expired;
+    dropExpired(expired);
+
+    std::optional<T> item;
+    if (!items.empty()) {
+        item = takeFirst();
+    }
+
+    wake(notFull, waitingProducers, int(item.has_value()) + int(expired.size()));
+    report(locker, expired);
+    return item;
+}
+
+template<class T>
+std::optional<T> BlockingQueue<T>::peek() const
+{
+    if (drained()) {
+        return std::nullopt;
+    }
+
+    QMutexLocker locker(&mtx);
+    const qint64 now = expiringItems > 0 ? clock.elapsed() : 0;
+    for (const auto & slot : items) {
+        if (slot.expires == 0 || slot.expires > now) {
+            return slot.item;
+        }
+    }
+    return std::nullopt;
+}
+
+template<class T>
+QList<T> BlockingQueue<T>::dequeueMany(int maxItems, qint64 timeout)
+{
+    QList<T> result;
+    drainTo(result, maxItems, timeout);
+    return result;
+}
+
+template<class T>
+template<class Container>
+int BlockingQueue<T>::drainTo(Container & container, int maxItems, qint64 timeout)
+{
+    if (maxItems <= 0 || (timeout == 0 && drained())) {
+        return 0;
+    }
+
+    QMutexLocker locker(&mtx);
+    spin(timeout);
+
+    std::vector<T> expired;
+    int count = 0;
+    if (detail::waitUntil(mtx, notEmpty, waitingConsumers, timeout,
+                          [&]() -> bool { dropExpired(expired); return closed || !items.empty(); })) {
+        // Whatever else is there right now comes along without waiting,
+        // stale items in between are dropped on the way
+        while (count < maxItems && !items.empty()) {
+            container.push_back(takeFirst());
+            ++count;
+            dropExpired(expired);
+        }
+    }
+
+    wake(notFull, waitingProducers, count + int(expired.size()));
+    report(locker, expired);
+    return count;
 }
 
 template<class T>
 int BlockingQueue<T>::size() const
 {
-    QReadLocker locker(&mtx);
-    return items.size();
+    QMutexLocker locker(&mtx);
+    return int(items.size());
+}
+
+template<class T>
+int BlockingQueue<T>::capacity() const
+{
+    return limit;
+}
+
+template<class T>
+OverflowPolicy BlockingQueue<T>::overflowPolicy() const
+{
+    return policy;
+}
+
+template<class T>
+typename BlockingQueue<T>::Stats BlockingQueue<T>::stats() const
+{
+    QMutexLocker locker(&mtx);
+    return counters;
+}
+
+template<class T>
+void BlockingQueue<T>::setSpinLimit(int iterations)
+{
+    maxSpin.store(qMax(iterations, 0));
+    spinBudget.store(qMax(iterations, 0));
+}
+
+template<class T>
+int BlockingQueue<T>::spinLimit() const
+{
+    return maxSpin.load();
+}
+
+template<class T>
+void BlockingQueue<T>::setItemLifetime(qint64 lifetimeMsec)
+{
+    QMutexLocker locker(&mtx);
+    lifetime = qMax<qint64>(lifetimeMsec, 0);
+}
+
+template<class T>
+qint64 BlockingQueue<T>::itemLifetime() const
+{
+    QMutexLocker locker(&mtx);
+    return lifetime;
+}
+
+template<class T>
+void BlockingQueue<T>::installExpirationHandler(Handler handler)
+{
+    QMutexLocker locker(&mtx);
+    expirationHandler = handler;
+}
+
+template<class T>
+quint64 BlockingQueue<T>::expiredCount() const
+{
+    QMutexLocker locker(&mtx);
+    return counters.expired;
+}
+
+template<class T>
+void BlockingQueue<T>::close()
+{
+    QMutexLocker locker(&mtx);
+    closed = true;
+
+    notEmpty.wakeAll();
+    notFull.wakeAll();
+}
+
+template<class T>
+bool BlockingQueue<T>::isClosed() const
+{
+    QMutexLocker locker(&mtx);
+    return closed;
+}
+
+template<class T>
+typename BlockingQueue<T>::Iterator BlockingQueue<T>::begin()
+{
+    return Iterator(this);
+}
+
+template<class T>
+typename BlockingQueue<T>::Iterator BlockingQueue<T>::end()
+{
+    return Iterator();
+}
+
+template<class T>
+T BlockingQueue<T>::takeFirst()
+{
+    T item = std::move(items.front().item);
+    if (items.front().expires != 0) {
+        --expiringItems;
+    }
+
+    items.pop_front();
+    available.store(int(items.size()), std::memory_order_relaxed);
+    return item;
+}
+
+template<class T>
+bool BlockingQueue<T>::overflow()
+{
+    switch (policy) {
+    case OverflowPolicy::DropOldest:
+        takeFirst();
+        ++counters.dropped;
+        return true;
+    case OverflowPolicy::DropNewest:
+        ++counters.dropped;
+        return false;
+    default:
+        ++counters.rejected;
+        return false;
+    }
+}
+
+template<class T>
+qint64 BlockingQueue<T>::deadline(qint64 lifetimeMsec)
+{
+    const qint64 effective = (lifetimeMsec > 0) ? lifetimeMsec : lifetime;
+    if (effective <= 0) {
+        return 0;
+    }
+
+    ++expiringItems;
+    return clock.elapsed() + effective;
+}
+
+template<class T>
+void BlockingQueue<T>::dropExpired(std::vector<T> & expired)
+{
+    if (expiringItems == 0) {
+        return;
+    }
+
+    // Only the head is checked, a stale item behind a fresh one waits
+    // until it gets to the front
+    const qint64 now = clock.elapsed();
+    while (!items.empty() && items.front().expires != 0 && items.front().expires <= now) {
+        expired.push_back(takeFirst());
+        ++counters.expired;
+    }
+}
+
+template<class T>
+template<class Locker>
+void BlockingQueue<T>::report(Locker & locker, const std::vector<T> & expired)
+{
+    if (expired.empty() || !expirationHandler) {
+        return;
+    }
+
+    const Handler handler = expirationHandler;
+    locker.unlock();
+
+    for (const auto & item : expired) {
+        handler(item);
+    }
+}
+
+template<class T>
+void BlockingQueue<T>::wake(QWaitCondition & condition, int waiters, int count)
+{
+    if (waiters == 0 || count <= 0) {
+        return;
+    }
+
+    if (count >= waiters) {
+        condition.wakeAll();
+    } else {
+        for (int i = 0; i < count; ++i) {
+            condition.wakeOne();
+        }
+    }
+}
+
+template<class T>
+int BlockingQueue<T>::freeSlots() const
+{
+    return (limit > 0) ? limit - int(items.size()) : INT_MAX;
+}
+
+template<class T>
+bool BlockingQueue<T>::drained() const
+{
+    // Pairs with the release store of every enqueue, a producer that
+    // finished before this call is always seen
+    return (available.load(std::memory_order_acquire) <= 0);
+}
+
+template<class T>
+void BlockingQueue<T>::spin(qint64 timeout)
+{
+    const int ceiling = maxSpin.load(std::memory_order_relaxed);
+    if (ceiling == 0 || timeout == 0 || closed || !items.empty()) {
+        return;
+    }
+
+    mtx.unlock();
+
+    const int budget = qMax(spinBudget.load(std::memory_order_relaxed), 1);
+    bool arrived = false;
+    for (int i = 0; i < budget && !arrived; ++i) {
+        relax();
+        arrived = (available.load(std::memory_order_acquire) > 0);
+    }
+
+    spinBudget.store(arrived ? qMin(budget * 2, ceiling) : qMax(budget / 2, 1),
+                     std::memory_order_relaxed);
+
+    mtx.lock();
+}
+
+template<class T>
+void BlockingQueue<T>::relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
 }
 
 }
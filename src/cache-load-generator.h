@@ -0,0 +1,236 @@
+#pragma once
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QHostAddress>
+#include <QIODevice>
+#include <QList>
+#include <QLocalSocket>
+#include <QString>
+#include <QTcpSocket>
+#include <QVector>
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+
+namespace qtstorage {
+
+struct CacheLoadOptions {
+    QString localName;
+    QHostAddress address = QHostAddress(QHostAddress::LocalHost);
+    quint16 port = 11211;
+
+    int connections = 4;
+    int pipelineDepth = 16;
+    int requestsPerConnection = 100000;
+
+    int keySpace = 10000;
+    int keysPerGet = 1;
+    int valueBytes = 100;
+    double setRatio = 0.1;
+};
+
+struct CacheLoadReport {
+    qint64 requests = 0;
+    qint64 errors = 0;
+    qint64 elapsedMsec = 0;
+
+    // Round trip of one pipelined batch
+    qint64 p50Usec = 0;
+    qint64 p99Usec = 0;
+    qint64 maxUsec = 0;
+
+    double throughput() const {
+        return (elapsedMsec > 0) ? double(requests) * 1000.0 / double(elapsedMsec) : 0.0;
+    }
+};
+
+// Drives a CacheServer (or any memcached) with pipelined get/set batches
+// from one blocking connection per thread
+class CacheLoadGenerator {
+public:
+    using Options = CacheLoadOptions;
+    using Report = CacheLoadReport;
+
+public:
+    static inline Report run(const Options & options);
+
+private:
+    struct Worker {
+        qint64 requests = 0;
+        qint64 errors = 0;
+        std::vector<qint64> latenciesUsec;
+    };
+
+    static inline void drive(const Options & options, int seed, Worker * worker);
+    static inline std::unique_ptr<QIODevice> connect(const Options & options);
+    static inline bool readReplies(QIODevice * socket,
+                                   QByteArray & buffer,
+                                   int expected,
+                                   qint64 * errors);
+};
+
+CacheLoadReport CacheLoadGenerator::run(const Options & options)
+{
+    std::vector<Worker> workers(size_t(options.connections));
+    std::vector<std::thread> threads;
+
+    QElapsedTimer timer;
+    timer.start();
+
+    for (int i = 0; i < options.connections; ++i) {
+        threads.emplace_back([&options, &workers, i]() -> void
+        {
+            drive(options, i, &workers[size_t(i)]);
+        });
+    }
+
+    for (auto & thread : threads) {
+        thread.join();
+    }
+
+    Report report;
+    report.elapsedMsec = timer.elapsed();
+
+    std::vector<qint64> latencies;
+    for (const auto & worker : workers) {
+        report.requests += worker.requests;
+        report.errors += worker.errors;
+        latencies.insert(latencies.end(), worker.latenciesUsec.begin(), worker.latenciesUsec.end());
+    }
+
+    if (!latencies.empty()) {
+        std::sort(latencies.begin(), latencies.end());
+        report.p50Usec = latencies[latencies.size() / 2];
+        report.p99Usec = latencies[std::min(latencies.size() - 1, latencies.size() * 99 / 100)];
+        report.maxUsec = latencies.back();
+    }
+
+    return report;
+}
+
+void CacheLoadGenerator::drive(const Options & options, int seed, Worker * worker)
+{
+    auto socket = connect(options);
+    if (!socket) {
+        worker->errors += options.requestsPerConnection;
+        return;
+    }
+
+    std::mt19937 random(quint32(seed) + 1);
+    std::uniform_int_distribution<int> keys(0, std::max(0, options.keySpace - 1));
+    std::uniform_real_distribution<double> operations(0.0, 1.0);
+
+    const QByteArray value(options.valueBytes, 'x');
+    const QByteArray valueHeader = QByteArray(" 0 0 ") + QByteArray::number(value.size()) + "\r\n";
+
+    QByteArray buffer;
+    QElapsedTimer timer;
+
+    for (int sent = 0; sent < options.requestsPerConnection; ) {
+        const int batch = std::min(options.pipelineDepth, options.requestsPerConnection - sent);
+
+        QByteArray requests;
+        for (int i = 0; i < batch; ++i) {
+            if (operations(random) < options.setRatio) {
+                requests.append("set key:").append(QByteArray::number(keys(random)))
+                        .append(valueHeader).append(value).append("\r\n");
+            } else {
+                requests.append("get");
+                for (int k = 0; k < options.keysPerGet; ++k) {
+                    requests.append(" key:").append(QByteArray::number(keys(random)));
+                }
+                requests.append("\r\n");
+            }
+        }
+
+        timer.start();
+        socket->write(requests);
+        if (!readReplies(socket.get(), buffer, batch, &worker->errors)) {
+            worker->errors += options.requestsPerConnection - sent;
+            return;
+        }
+
+        worker->latenciesUsec.push_back(timer.nsecsElapsed() / 1000);
+        worker->requests += batch;
+        sent += batch;
+    }
+}
+
+std::unique_ptr<QIODevice> CacheLoadGenerator::connect(const Options & options)
+{
+    if (!options.localName.isEmpty()) {
+        std::unique_ptr<QLocalSocket> socket(new QLocalSocket);
+        socket->connectToServer(options.localName);
+        if (!socket->waitForConnected(5000)) {
+            return nullptr;
+        }
+        return std::unique_ptr<QIODevice>(socket.release());
+    }
+
+    std::unique_ptr<QTcpSocket> socket(new QTcpSocket);
+    socket->connectToHost(options.address, options.port);
+    if (!socket->waitForConnected(5000)) {
+        return nullptr;
+    }
+
+    socket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+    return std::unique_ptr<QIODevice>(socket.release());
+}
+
+bool CacheLoadGenerator::readReplies(QIODevice * socket,
+                                     QByteArray & buffer,
+                                     int expected,
+                                     qint64 * errors)
+{
+    int completed = 0;
+    int offset = 0;
+
+    while (completed < expected) {
+        const int lineEnd = buffer.indexOf("\r\n", offset);
+        if (lineEnd < 0) {
+            buffer.remove(0, offset);
+            offset = 0;
+
+            if (!socket->waitForReadyRead(5000)) {
+                return false;
+            }
+            buffer.append(socket->readAll());
+            continue;
+        }
+
+        const QByteArray line = buffer.mid(offset, lineEnd - offset);
+        if (line.startsWith("VALUE ")) {
+            const int size = line.split(' ').value(3).toInt();
+
+            if (buffer.size() < lineEnd + 2 + size + 2) {
+                buffer.remove(0, offset);
+                offset = 0;
+
+                if (!socket->waitForReadyRead(5000)) {
+                    return false;
+                }
+                buffer.append(socket->readAll());
+                continue;
+            }
+
+            offset = lineEnd + 2 + size + 2;
+            continue;
+        }
+
+        if (line.startsWith("ERROR") || line.contains("_ERROR")) {
+            ++*errors;
+        }
+
+        ++completed;
+        offset = lineEnd + 2;
+    }
+
+    buffer.remove(0, offset);
+    return true;
+}
+
+}
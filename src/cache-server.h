@@ -0,0 +1,336 @@
+#pragma once
+
+#include <QByteArray>
+#include <QDateTime>
+#include <QHostAddress>
+#include <QList>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QSharedPointer>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <limits>
+
+#include "expiring-storage.h"
+
+
+namespace qtstorage {
+
+struct CacheServerOptions {
+    // Largest value set, add and replace accept, like memcached's -I
+    int maxItemBytes = 1024 * 1024;
+};
+
+// Serves an ExpiringStorage over the memcached text protocol (get, gets,
+// set, add, replace, delete, touch, flush_all, version, quit)
+class CacheServer {
+public:
+    using Storage = ExpiringStorage<QByteArray, QByteArray>;
+    using Options = CacheServerOptions;
+
+public:
+    inline explicit CacheServer(Storage * storage, const Options & options = Options());
+
+    inline bool listen(const QString & localName);
+    inline bool listen(const QHostAddress & address, quint16 port);
+    inline void close();
+
+private:
+    static constexpr int MaxLineLength = 2048;
+    static constexpr qint64 RelativeExpiryLimit = 60 * 60 * 24 * 30;
+
+    template<class Socket>
+    inline void serve(Socket * socket);
+
+    inline bool execute(const QByteArray & buffer,
+                        int & offset,
+                        QByteArray & response,
+                        qint64 & discard,
+                        bool & quit);
+
+    inline void retrieve(const QList<QByteArray> & tokens, QByteArray & response);
+    inline QByteArray store(const QList<QByteArray> & tokens, const QByteArray & data);
+    inline QByteArray touch(const QList<QByteArray> & tokens);
+
+    static inline bool lifetime(const QByteArray & exptime, qint64 * lifetimeMsec);
+    static inline QByteArray pack(quint32 flags, const QByteArray & data);
+    static inline quint32 flagsOf(const QByteArray & packed);
+
+private:
+    Storage * storage;
+    const Options opts;
+    QLocalServer localServer;
+    QTcpServer tcpServer;
+};
+
+CacheServer::CacheServer(Storage * storage, const Options & options) :
+    storage(storage),
+    opts(options)
+{
+    QObject::connect(&localServer, &QLocalServer::newConnection, &localServer, [this]() -> void
+    {
+        while (auto * socket = localServer.nextPendingConnection()) {
+            serve(socket);
+        }
+    });
+
+    QObject::connect(&tcpServer, &QTcpServer::newConnection, &tcpServer, [this]() -> void
+    {
+        while (auto * socket = tcpServer.nextPendingConnection()) {
+            socket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+            serve(socket);
+        }
+    });
+}
+
+bool CacheServer::listen(const QString & localName)
+{
+    QLocalServer::removeServer(localName);
+    return localServer.listen(localName);
+}
+
+bool CacheServer::listen(const QHostAddress & address, quint16 port)
+{
+    return tcpServer.listen(address, port);
+}
+
+void CacheServer::close()
+{
+    localServer.close();
+    tcpServer.close();
+}
+
+template<class Socket>
+void CacheServer::serve(Socket * socket)
+{
+    auto buffer = QSharedPointer<QByteArray>::create();
+    auto discard = QSharedPointer<qint64>::create(0);
+
+    QObject::connect(socket, &Socket::disconnected, socket, &QObject::deleteLater);
+    QObject::connect(socket, &Socket::readyRead, socket, [this, socket, buffer, discard]() -> void
+    {
+        buffer->append(socket->readAll());
+
+        // The rest of a rejected oversized value is dropped as it arrives
+        if (*discard > 0) {
+            const int dropped = int(qMin<qint64>(*discard, buffer->size()));
+            buffer->remove(0, dropped);
+            *discard -= dropped;
+        }
+
+        // Every complete command in the buffer is executed and all replies
+        // go out in a single write, which is what makes pipelining cheap
+        QByteArray response;
+        int offset = 0;
+        bool quit = false;
+
+        while (!quit && *discard == 0 && execute(*buffer, offset, response, *discard, quit)) {}
+        buffer->remove(0, offset);
+
+        if (!response.isEmpty()) {
+            socket->write(response);
+        }
+
+        if (quit || (buffer->size() > MaxLineLength && buffer->indexOf("\r\n") < 0)) {
+            socket->close();
+        }
+    });
+}
+
+bool CacheServer::execute(const QByteArray & buffer,
+                          int & offset,
+                          QByteArray & response,
+                          qint64 & discard,
+                          bool & quit)
+{
+    const int lineEnd = buffer.indexOf("\r\n", offset);
+    if (lineEnd < 0) {
+        return false;
+    }
+
+    QList<QByteArray> tokens;
+    for (const auto & token : buffer.mid(offset, lineEnd - offset).split(' ')) {
+        if (!token.isEmpty()) {
+            tokens.append(token);
+        }
+    }
+
+    int next = lineEnd + 2;
+    const QByteArray command = tokens.value(0);
+
+    if (command == "get" || command == "gets") {
+        retrieve(tokens, response);
+    } else if (command == "set" || command == "add" || command == "replace") {
+        bool ok = false;
+        const int bytes = tokens.value(4).toInt(&ok);
+        if (!ok || bytes < 0) {
+            response.append("CLIENT_ERROR bad command line format\r\n");
+        } else if (bytes > opts.maxItemBytes) {
+            // Refused without waiting for the data, whatever of it isn't
+            // buffered yet is discarded on arrival
+            const qint64 remaining = qint64(bytes) + 2;
+            const int available = buffer.size() - next;
+            if (available >= remaining) {
+                next += int(remaining);
+            } else {
+                discard = remaining - available;
+                next = buffer.size();
+            }
+
+            if (tokens.value(5) != "noreply") {
+                response.append("SERVER_ERROR object too large for cache\r\n");
+            }
+        } else {
+            if (buffer.size() < next + bytes + 2) {
+                return false;
+            }
+
+            const QByteArray data = buffer.mid(next, bytes);
+            const bool terminated = (buffer.mid(next + bytes, 2) == "\r\n");
+            next += bytes + 2;
+
+            const QByteArray reply = terminated ? store(tokens, data)
+                                                : QByteArray("CLIENT_ERROR bad data chunk\r\n");
+            if (tokens.value(5) != "noreply") {
+                response.append(reply);
+            }
+        }
+    } else if (command == "delete") {
+        const QByteArray reply = storage->remove(tokens.value(1)) ? "DELETED\r\n" : "NOT_FOUND\r\n";
+        if (tokens.value(2) != "noreply") {
+            response.append(reply);
+        }
+    } else if (command == "touch") {
+        const QByteArray reply = touch(tokens);
+        if (tokens.value(3) != "noreply") {
+            response.append(reply);
+        }
+    } else if (command == "flush_all") {
+        storage->clear();
+        if (!tokens.contains("noreply")) {
+            response.append("OK\r\n");
+        }
+    } else if (command == "version") {
+        response.append("VERSION qtstorage\r\n");
+    } else if (command == "quit") {
+        quit = true;
+    } else {
+        response.append("ERROR\r\n");
+    }
+
+    offset = next;
+    return true;
+}
+
+void CacheServer::retrieve(const QList<QByteArray> & tokens, QByteArray & response)
+{
+    const bool withCas = (tokens.value(0) == "gets");
+
+    for (int i = 1; i < tokens.size(); ++i) {
+        const QByteArray packed = storage->value(tokens.at(i));
+        if (packed.size() < int(sizeof(quint32))) {
+            continue;
+        }
+
+        const QByteArray data = packed.mid(sizeof(quint32));
+        response.append("VALUE ").append(tokens.at(i))
+                .append(' ').append(QByteArray::number(flagsOf(packed)))
+                .append(' ').append(QByteArray::number(data.size()));
+        if (withCas) {
+            response.append(" 0");
+        }
+        response.append("\r\n").append(data).append("\r\n");
+    }
+
+    response.append("END\r\n");
+}
+
+QByteArray CacheServer::store(const QList<QByteArray> & tokens, const QByteArray & data)
+{
+    const QByteArray & command = tokens.at(0);
+    const QByteArray & key = tokens.at(1);
+
+    bool ok = false;
+    const quint32 flags = tokens.value(2).toUInt(&ok);
+    qint64 lifetimeMsec = 0;
+    if (!ok || key.size() > 250 || !lifetime(tokens.value(3), &lifetimeMsec)) {
+        return "CLIENT_ERROR bad command line format\r\n";
+    }
+
+    const bool exists = storage->contains(key);
+    if ((command == "add" && exists) || (command == "replace" && !exists)) {
+        return "NOT_STORED\r\n";
+    }
+
+    if (lifetimeMsec < 0) {
+        storage->remove(key);
+        return "STORED\r\n";
+    }
+
+    // An overwrite takes the new exptime, 0 included, in one step
+    storage->replace(key, pack(flags, data), lifetimeMsec);
+    return "STORED\r\n";
+}
+
+QByteArray CacheServer::touch(const QList<QByteArray> & tokens)
+{
+    const QByteArray & key = tokens.value(1);
+
+    qint64 lifetimeMsec = 0;
+    if (!lifetime(tokens.value(2), &lifetimeMsec)) {
+        return "CLIENT_ERROR bad command line format\r\n";
+    }
+
+    const bool found = (lifetimeMsec < 0) ? storage->remove(key)
+                                          : storage->setLifetime(key, lifetimeMsec);
+    return found ? "TOUCHED\r\n" : "NOT_FOUND\r\n";
+}
+
+bool CacheServer::lifetime(const QByteArray & exptime, qint64 * lifetimeMsec)
+{
+    bool ok = false;
+    const qint64 seconds = exptime.toLongLong(&ok);
+    if (!ok) {
+        return false;
+    }
+
+    // Memcached treats values beyond 30 days as absolute unix time,
+    // a negative lifetime means the item is already expired
+    if (seconds == 0) {
+        *lifetimeMsec = 0;
+    } else if (seconds < 0) {
+        *lifetimeMsec = -1;
+    } else if (seconds <= RelativeExpiryLimit) {
+        *lifetimeMsec = seconds * 1000;
+    } else {
+        // Clamped so that a huge exptime from a client can't overflow
+        const qint64 absolute = qMin(seconds, std::numeric_limits<qint64>::max() / 1000) * 1000;
+        const qint64 remaining = absolute - QDateTime::currentMSecsSinceEpoch();
+        *lifetimeMsec = (remaining > 0) ? remaining : -1;
+    }
+
+    return true;
+}
+
+QByteArray CacheServer::pack(quint32 flags, const QByteArray & data)
+{
+    QByteArray packed;
+    packed.reserve(int(sizeof(flags)) + data.size());
+    packed.append(char(flags >> 24));
+    packed.append(char(flags >> 16));
+    packed.append(char(flags >> 8));
+    packed.append(char(flags));
+    packed.append(data);
+    return packed;
+}
+
+quint32 CacheServer::flagsOf(const QByteArray & packed)
+{
+    const auto * bytes = reinterpret_cast<const uchar *>(packed.constData());
+    return (quint32(bytes[0]) << 24)
+         | (quint32(bytes[1]) << 16)
+         | (quint32(bytes[2]) << 8)
+         | quint32(bytes[3]);
+}
+
+}
@@ -0,0 +1,225 @@
+#pragma once
+
+#include <QList>
+#include <QMap>
+#include <QMutex>
+#include <QWaitCondition>
+#include <deque>
+#include <optional>
+#include <utility>
+
+#include "detail/wait.h"
+
+
+namespace qtstorage {
+
+// Keyed BlockingQueue where the latest value wins: enqueueing a key
+// that is still pending replaces its value in place and keeps its
+// position, so a consumer sees each key at most once per drain
+template <class K, class T>
+class CoalescingQueue {
+public:
+    using Entry = std::pair<K, T>;
+
+public:
+    // The capacity limits distinct pending keys, replacing a pending
+    // value never waits
+    inline explicit CoalescingQueue(int capacity = 0);
+
+    inline bool enqueue(const K & key, const T & value, qint64 timeout = -1);
+    inline bool enqueue(const K & key, T && value, qint64 timeout = -1);
+    inline bool tryEnqueue(const K & key, const T & value);
+    inline Entry dequeue(qint64 timeout = -1, bool * ok = nullptr);
+    inline std::optional<Entry> dequeueFor(qint64 timeout);
+    inline std::optional<Entry> tryDequeue();
+    inline QList<Entry> dequeueMany(int maxItems, qint64 timeout = -1);
+    inline bool contains(const K & key) const;
+    inline int size() const;
+    inline int capacity() const;
+
+    // Values replaced before a consumer got to them
+    inline quint64 coalescedCount() const;
+
+    inline void close();
+    inline bool isClosed() const;
+
+private:
+    template<class Value>
+    inline bool put(const K & key, Value && value, qint64 timeout);
+    inline Entry takeFirst();
+
+
+private:
+    // Keys in arrival order, each pending key appears exactly once
+    std::deque<K> order;
+    QMap<K, T> values;
+    quint64 coalesced = 0;
+
+    mutable QMutex mtx;
+    QWaitCondition notEmpty;
+    QWaitCondition notFull;
+    int waitingConsumers = 0;
+    int waitingProducers = 0;
+    bool closed = false;
+
+    const int limit;
+};
+
+template<class K, class T>
+CoalescingQueue<K, T>::CoalescingQueue(int capacity) :
+    limit(qMax(capacity, 0))
+{}
+
+template<class K, class T>
+bool CoalescingQueue<K, T>::enqueue(const K & key, const T & value, qint64 timeout)
+{
+    return put(key, value, timeout);
+}
+
+template<class K, class T>
+bool CoalescingQueue<K, T>::enqueue(const K & key, T && value, qint64 timeout)
+{
+    return put(key, std::move(value), timeout);
+}
+
+template<class K, class T>
+bool CoalescingQueue<K, T>::tryEnqueue(const K & key, const T & value)
+{
+    return put(key, value, 0);
+}
+
+template<class K, class T>
+typename CoalescingQueue<K, T>::Entry CoalescingQueue<K, T>::dequeue(qint64 timeout, bool * ok)
+{
+    return detail::unwrap(dequeueFor(timeout), ok);
+}
+
+template<class K, class T>
+std::optional<typename CoalescingQueue<K, T>::Entry> CoalescingQueue<K, T>::dequeueFor(qint64 timeout)
+{
+    QMutexLocker locker(&mtx);
+    if (!detail::waitUntil(mtx, notEmpty, waitingConsumers, timeout, [this]() -> bool { return closed || !order.empty(); })
+            || order.empty()) {
+        return std::nullopt;
+    }
+
+    std::optional<Entry> entry(takeFirst());
+    if (waitingProducers > 0) {
+        notFull.wakeOne();
+    }
+    return entry;
+}
+
+template<class K, class T>
+std::optional<typename CoalescingQueue<K, T>::Entry> CoalescingQueue<K, T>::tryDequeue()
+{
+    return dequeueFor(0);
+}
+
+template<class K, class T>
+QList<typename CoalescingQueue<K, T>::Entry> CoalescingQueue<K, T>::dequeueMany(int maxItems, qint64 timeout)
+{
+    QList<Entry> result;
+    if (maxItems <= 0) {
+        return result;
+    }
+
+    QMutexLocker locker(&mtx);
+    if (!detail::waitUntil(mtx, notEmpty, waitingConsumers, timeout, [this]() -> bool { return closed || !order.empty(); })) {
+        return result;
+    }
+
+    while (result.size() < maxItems && !order.empty()) {
+        result.append(takeFirst());
+    }
+
+    if (waitingProducers > 0 && !result.isEmpty()) {
+        notFull.wakeAll();
+    }
+    return result;
+}
+
+template<class K, class T>
+bool CoalescingQueue<K, T>::contains(const K & key) const
+{
+    QMutexLocker locker(&mtx);
+    return values.contains(key);
+}
+
+template<class K, class T>
+int CoalescingQueue<K, T>::size() const
+{
+    QMutexLocker locker(&mtx);
+    return int(order.size());
+}
+
+template<class K, class T>
+int CoalescingQueue<K, T>::capacity() const
+{
+    return limit;
+}
+
+template<class K, class T>
+quint64 CoalescingQueue<K, T>::coalescedCount() const
+{
+    QMutexLocker locker(&mtx);
+    return coalesced;
+}
+
+template<class K, class T>
+void CoalescingQueue<K, T>::close()
+{
+    QMutexLocker locker(&mtx);
+    closed = true;
+
+    notEmpty.wakeAll();
+    notFull.wakeAll();
+}
+
+template<class K, class T>
+bool CoalescingQueue<K, T>::isClosed() const
+{
+    QMutexLocker locker(&mtx);
+    return closed;
+}
+
+template<class K, class T>
+template<class Value>
+bool CoalescingQueue<K, T>::put(const K & key, Value && value, qint64 timeout)
+{
+    QMutexLocker locker(&mtx);
+    const auto ready = [&]() -> bool {
+        return closed || values.contains(key) || limit == 0 || int(order.size()) < limit;
+    };
+    if (!detail::waitUntil(mtx, notFull, waitingProducers, timeout, ready) || closed) {
+        return false;
+    }
+
+    // Already pending: the consumer will pick up the new value instead
+    auto it = values.find(key);
+    if (it != values.end()) {
+        it.value() = std::forward<Value>(value);
+        ++coalesced;
+        return true;
+    }
+
+    order.push_back(key);
+    values.insert(key, std::forward<Value>(value));
+
+    if (waitingConsumers > 0) {
+        notEmpty.wakeOne();
+    }
+    return true;
+}
+
+template<class K, class T>
+typename CoalescingQueue<K, T>::Entry CoalescingQueue<K, T>::takeFirst()
+{
+    K key = std::move(order.front());
+    order.pop_front();
+
+    T value = values.take(key);
+    return Entry(std::move(key), std::move(value));
+}
+
+}
@@ -0,0 +1,193 @@
+#pragma once
+
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QWaitCondition>
+#include <algorithm>
+#include <climits>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "detail/wait.h"
+
+
+namespace qtstorage {
+
+// Unbounded queue whose items become available only once their delay
+// has elapsed, consumers sleep until the earliest deadline or until an
+// earlier item shows up
+template <class T>
+class DelayQueue {
+public:
+    inline DelayQueue();
+
+    inline bool enqueue(const T & item, qint64 delayMsec = 0);
+    inline bool enqueue(T && item, qint64 delayMsec = 0);
+    inline T dequeue(qint64 timeout = -1, bool * ok = nullptr);
+    inline std::optional<T> dequeueFor(qint64 timeout);
+    inline std::optional<T> tryDequeue();
+    inline int size() const;
+
+    // Stops accepting items, the pending ones are still handed out as
+    // they come due and consumers return empty once none are left
+    inline void close();
+    inline bool isClosed() const;
+
+private:
+    struct Entry {
+        qint64 due;
+        quint64 order;
+        T item;
+    };
+
+    // Min-heap on the deadline, equal deadlines in insertion order
+    struct Later {
+        inline bool operator()(const Entry & left, const Entry & right) const;
+    };
+
+    inline bool put(T && item, qint64 delayMsec);
+    inline T takeFirst();
+
+private:
+    std::vector<Entry> heap;
+    quint64 nextOrder = 0;
+
+    // Monotonic, so wall clock adjustments don't move the deadlines
+    QElapsedTimer clock;
+
+    mutable QMutex mtx;
+    QWaitCondition changed;
+    int waitingConsumers = 0;
+    bool closed = false;
+};
+
+template<class T>
+DelayQueue<T>::DelayQueue()
+{
+    clock.start();
+}
+
+template<class T>
+bool DelayQueue<T>::enqueue(const T & item, qint64 delayMsec)
+{
+    return put(T(item), delayMsec);
+}
+
+template<class T>
+bool DelayQueue<T>::enqueue(T && item, qint64 delayMsec)
+{
+    return put(std::move(item), delayMsec);
+}
+
+template<class T>
+T DelayQueue<T>::dequeue(qint64 timeout, bool * ok)
+{
+    return detail::unwrap(dequeueFor(timeout), ok);
+}
+
+template<class T>
+std::optional<T> DelayQueue<T>::dequeueFor(qint64 timeout)
+{
+    QMutexLocker locker(&mtx);
+    const qint64 started = clock.elapsed();
+
+    while (true) {
+        const qint64 now = clock.elapsed();
+        if (!heap.empty() && heap.front().due <= now) {
+            return std::optional<T>(takeFirst());
+        }
+        if (heap.empty() && closed) {
+            return std::nullopt;
+        }
+
+        // Sleep until whichever comes first: the earliest item is due
+        // or the caller's timeout runs out
+        qint64 wait = heap.empty() ? -1 : heap.front().due - now;
+        if (timeout >= 0) {
+            const qint64 remaining = timeout - (now - started);
+            if (remaining <= 0) {
+                return std::nullopt;
+            }
+            wait = (wait < 0) ? remaining : qMin(wait, remaining);
+        }
+
+        ++waitingConsumers;
+        changed.wait(&mtx, (wait < 0) ? ULONG_MAX : (unsigned long)(wait));
+        --waitingConsumers;
+    }
+}
+
+template<class T>
+std::optional<T> DelayQueue<T>::tryDequeue()
+{
+    return dequeueFor(0);
+}
+
+template<class T>
+int DelayQueue<T>::size() const
+{
+    QMutexLocker locker(&mtx);
+    return int(heap.size());
+}
+
+template<class T>
+void DelayQueue<T>::close()
+{
+    QMutexLocker locker(&mtx);
+    closed = true;
+    changed.wakeAll();
+}
+
+template<class T>
+bool DelayQueue<T>::isClosed() const
+{
+    QMutexLocker locker(&mtx);
+    return closed;
+}
+
+template<class T>
+bool DelayQueue<T>::Later::operator()(const Entry & left, const Entry & right) const
+{
+    if (left.due != right.due) {
+        return left.due > right.due;
+    }
+    return left.order > right.order;
+}
+
+template<class T>
+bool DelayQueue<T>::put(T && item, qint64 delayMsec)
+{
+    QMutexLocker locker(&mtx);
+    if (closed) {
+        return false;
+    }
+
+    const qint64 due = clock.elapsed() + qMax<qint64>(delayMsec, 0);
+    heap.push_back(Entry{due, nextOrder++, std::move(item)});
+    std::push_heap(heap.begin(), heap.end(), Later());
+
+    // Sleepers only need to recompute their deadline when the new item
+    // is now the first one due
+    if (waitingConsumers > 0 && heap.front().order == nextOrder - 1) {
+        changed.wakeOne();
+    }
+    return true;
+}
+
+template<class T>
+T DelayQueue<T>::takeFirst()
+{
+    std::pop_heap(heap.begin(), heap.end(), Later());
+    T item = std::move(heap.back().item);
+    heap.pop_back();
+
+    // The next item goes to another sleeper, which may still wait on a
+    // deadline computed before that item existed
+    if (waitingConsumers > 0 && !heap.empty()) {
+        changed.wakeOne();
+    }
+    return item;
+}
+
+}
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QtGlobal>
+#include <atomic>
+#include <climits>
+#include <cstddef>
+#include <optional>
+#include <utility>
+
+
+namespace qtstorage {
+namespace detail {
+
+// Waits on the condition with the mutex held until ready() holds or the
+// timeout runs out, a negative timeout waits forever. Waiters are
+// counted so that the other side can skip waking nobody
+template<class Ready>
+inline bool waitUntil(QMutex & mtx,
+                      QWaitCondition & condition,
+                      int & waiters,
+                      qint64 timeout,
+                      Ready ready);
+
+// dequeue(timeout, ok) on top of dequeueFor(timeout)
+template<class T>
+inline T unwrap(std::optional<T> && item, bool * ok);
+
+// Ring sizes are powers of two, so a position maps to a slot by masking
+inline size_t roundUp(int capacity);
+
+// Sleeping for the lock-free queues: a side that can't make progress
+// registers as a waiter under the mutex and retries, the other side
+// only takes the mutex to wake it when it sees a registered waiter
+template<class Attempt>
+inline bool block(QMutex & mtx,
+                  QWaitCondition & condition,
+                  std::atomic<int> & waiters,
+                  qint64 timeout,
+                  Attempt attempt);
+inline void wake(QMutex & mtx, QWaitCondition & condition, std::atomic<int> & waiters);
+
+template<class Ready>
+bool waitUntil(QMutex & mtx,
+               QWaitCondition & condition,
+               int & waiters,
+               qint64 timeout,
+               Ready ready)
+{
+    if (ready()) {
+        return true;
+    }
+    if (timeout == 0) {
+        return false;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+
+    bool result = true;
+    ++waiters;
+    while (!ready()) {
+        const qint64 remaining = (timeout < 0) ? -1 : timeout - timer.elapsed();
+        if (timeout >= 0 && remaining <= 0) {
+            result = false;
+            break;
+        }
+
+        condition.wait(&mtx, (remaining < 0) ? ULONG_MAX : (unsigned long)(remaining));
+    }
+    --waiters;
+
+    return result;
+}
+
+template<class T>
+T unwrap(std::optional<T> && item, bool * ok)
+{
+    if (ok) { *ok = item.has_value(); }
+
+    if (!item) {
+        return T();
+    }
+    return std::move(*item);
+}
+
+size_t roundUp(int capacity)
+{
+    size_t result = 2;
+    while (result < size_t(qMax(capacity, 2))) {
+        result <<= 1;
+    }
+    return result;
+}
+
+template<class Attempt>
+bool block(QMutex & mtx,
+           QWaitCondition & condition,
+           std::atomic<int> & waiters,
+           qint64 timeout,
+           Attempt attempt)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    QMutexLocker locker(&mtx);
+    waiters.fetch_add(1);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    // Registering as a waiter before the retry pairs with the fence in
+    // wake(), so either the retry succeeds or the other side sees us
+    bool done = attempt();
+    while (!done) {
+        const qint64 remaining = (timeout < 0) ? -1 : timeout - timer.elapsed();
+        if (timeout >= 0 && remaining <= 0) {
+            break;
+        }
+
+        condition.wait(&mtx, (remaining < 0) ? ULONG_MAX : (unsigned long)(remaining));
+        done = attempt();
+    }
+
+    waiters.fetch_sub(1);
+    return done;
+}
+
+void wake(QMutex & mtx, QWaitCondition & condition, std::atomic<int> & waiters)
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiters.load(std::memory_order_relaxed) > 0) {
+        QMutexLocker locker(&mtx);
+        condition.wakeOne();
+    }
+}
+
+}
+}
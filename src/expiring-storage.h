@@ -1,68 +1,452 @@
 #pragma once
 
+#include <QDataStream>
+#include <QDateTime>
 #include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QHash>
 #include <QMap>
+#include <QSaveFile>
 #include <QTimer>
 #include <QSharedPointer>
 #include <QReadWriteLock>
+#include <QVector>
+#include <atomic>
+#include <climits>
+#include <deque>
 #include <functional>
+#include <future>
+#include <random>
+#include <thread>
+#include <type_traits>
+
+#include "journal.h"
+#include "sharded-map.h"
+#include "spill-file.h"
 
 
 namespace qtstorage {
 
+// Keys need a qHash() overload as well as operator<: entries are spread
+// over shards by hash, so values(), keys and iteration come in key order
+// within a shard only, shard after shard
 template <class K, class V>
 class ExpiringStorage {
 public:
     using Handler = std::function<void(K,V)>;
+    using Codec = std::function<QByteArray(const QByteArray &)>;
+    using MutationHandler = std::function<void(quint64, const QByteArray &)>;
+    using RemovalHandler = std::function<void(const K &)>;
+
+    class const_iterator;
+
+    struct CompressionStats {
+        int entries = 0;
+        qint64 rawBytes = 0;
+        qint64 compressedBytes = 0;
+
+        double ratio() const {
+            return (compressedBytes > 0) ? double(rawBytes) / double(compressedBytes) : 1.0;
+        }
+    };
 
 public:
     inline void insert(const K & key,
                        const V & value,
                        qint64 lifetimeMsec = 0);
 
+    // Like insert(), but the lifetime given replaces the key's old one
+    // instead of leaving it running when 0
+    inline void replace(const K & key,
+                        const V & value,
+                        qint64 lifetimeMsec = 0);
+
+    // Restarts the key's lifetime, 0 keeps it until removed. False if
+    // the key isn't there
+    inline bool setLifetime(const K & key, qint64 lifetimeMsec);
+
     inline bool remove(const K & key);
     inline V take(const K & key);
     inline V value(const K & key, const V & defaultValue = V());
+    // In shard order, not key order
     inline QList<V> values();
 
     inline bool contains(const K & key);
     inline int size();
     inline void clear();
 
-    inline typename QMap<K,V>::const_iterator find(const K & key) const;
+    // Iterators walk a snapshot taken by begin(), resident and parked
+    // entries alike, in shard order, and don't see later changes. find()
+    // copies just the entry found, advancing its iterator reaches end()
+    inline const_iterator find(const K & key) const;
 
-    inline typename QMap<K,V>::const_iterator begin() const;
-    inline typename QMap<K,V>::const_iterator end() const;
+    inline const_iterator begin() const;
+    inline const_iterator end() const;
 
     inline void installExpirationHandler(Handler handler);
+    inline void installMutationHandler(MutationHandler handler);
+
+    // Called under the write lock for every key that leaves by remove(),
+    // take(), expiry or clear(), it must not call back into the storage
+    inline void installRemovalHandler(RemovalHandler handler);
+    inline bool apply(const QByteArray & mutation);
+
+    inline bool save(const QString & path);
+    inline bool save(QIODevice * device);
+    inline bool save(QIODevice * device, quint64 * sequence);
+    inline bool load(const QString & path);
+    inline bool load(QIODevice * device);
+
+    // Replaces the whole content with a snapshot in one step, readers
+    // see either the old or the new content. Only keys the snapshot
+    // doesn't hold count as removed, the rest as overwritten
+    inline bool reload(QIODevice * device);
+
+    inline bool saveMapped(const QString & path);
+    inline bool loadMapped(const QString & path);
+
+    inline std::future<bool> saveInBackground(const QString & path);
+
+    inline bool openJournal(const QString & path,
+                            const QString & snapshotPath,
+                            const Journal::Options & options = Journal::Options());
+    inline void closeJournal();
+    inline bool syncJournal();
+    inline std::future<bool> compactJournal();
+    inline bool restore(const QString & snapshotPath, const QString & journalPath);
+
+    inline bool enableSpill(const QString & directory,
+                            int maxResidentItems,
+                            qint64 segmentBytes = 64 * 1024 * 1024);
+    inline void compactSpill();
+
+    inline void enableCompression(int thresholdBytes,
+                                  Codec compressor = nullptr,
+                                  Codec decompressor = nullptr);
+    inline CompressionStats compressionStats();
 
 private:
+    struct Packed {
+        QByteArray data;
+        int rawSize;
+    };
+
+    enum class Operation : quint8 {
+        Insert = 1,
+        Remove = 2,
+        Clear = 3
+    };
+
+    // Implicitly shared copies of the containers: taking one costs a
+    // reference per shard under the read lock, a writer detaches only the
+    // shard it modifies and writing the snapshot drops each shard once it
+    // has been written, so the writer stops copying shards behind it
+    struct Snapshot {
+        ShardedMap<K,V> items;
+        ShardedMap<K, QByteArray> mapped;
+        ShardedMap<K, qint64> deadlines;
+        QList<QSharedPointer<QFile>> mappedFiles;
+        ShardedMap<K, SpillFile::Location> spilled;
+        ShardedMap<K, Packed> compressed;
+        Codec decompressor;
+        quint64 sequence;
+    };
+
+    static constexpr quint32 SnapshotMagic = 0x51545353;
+    static constexpr quint32 MappedSnapshotMagic = 0x5154534D;
+    static constexpr quint16 SnapshotVersion = 1;
+
+    static inline qint64 now();
+    static inline QByteArray encode(const V & value);
+    static inline V decode(const QByteArray & encoded);
+
+    inline Snapshot capture();
+    inline Snapshot share() const;
+    static inline bool writeSnapshot(QIODevice * device, Snapshot snapshot);
+    static inline bool writeSnapshot(const QString & path, Snapshot snapshot);
+    static inline bool writeMappedSnapshot(const QString & path, Snapshot snapshot);
+    static inline bool readSnapshot(QIODevice * device,
+                                    ShardedMap<K,V> * loaded,
+                                    ShardedMap<K,qint64> * loadedDeadlines);
+
+    // Visits shard by shard and releases each shard of the snapshot once
+    // it has been visited. Spilled values that can't be read back are
+    // skipped and make it return false
+    template<class Visitor>
+    static inline bool forEachEntry(Snapshot & snapshot, Visitor visitor);
+    static inline void writeValue(QDataStream & stream,
+                                  const V * value,
+                                  const QByteArray * encoded);
+
+    // Puts decoded snapshot entries in, over whatever is there
+    inline void install(const ShardedMap<K,V> & loaded, const ShardedMap<K,qint64> & loadedDeadlines);
+
+    inline void put(const K & key, const V & value, qint64 lifetimeMsec);
+    inline bool holds(const K & key) const;
+    inline bool fault(const K & key);
+    inline bool discard(const K & key);
+    inline bool dropParked(const K & key);
+    inline void dropAll(bool notify = true);
+    inline void notifyRemoved(const K & key);
+
+    inline bool pack(const V & value, Packed * packed) const;
+    static inline V unpack(const Packed & packed, const Codec & decompressor);
+    inline void addPacked(const K & key, const Packed & packed);
+
+    inline void track(const K & key);
+    inline void touch(const K & key);
+    inline void forget(const K & key);
+    inline void shed();
+    inline void compactSegments();
+
+    // An inserted value is given either decoded or as its encoding
+    inline void record(Operation operation,
+                       const K & key = K(),
+                       const V * value = nullptr,
+                       const QByteArray * encoded = nullptr);
+    inline bool replay(const QByteArray & record);
+    inline std::future<bool> startCompaction();
+    inline void scheduleCompaction(qint64 intervalMsec);
+
     inline void watch(const K & key,
                       qint64 lifetimeMsec = 0);
 
     inline QTimer * createTimer(const K & key);
     inline void removeTimer(const K & key);
 
+    // QTimer takes an int interval, longer lifetimes run as a chain of
+    // timers that each check the deadline before expiring the key
+    static inline void arm(QTimer * timer, qint64 remainingMsec);
+
 private:
     QObject ctx;
-    QReadWriteLock mtx;
+    mutable QReadWriteLock mtx;
     Handler expirationHandler = nullptr;
 
-    QMap<K,V> items;
+    // Keys need a qHash() overload, the maps are sharded by it
+    ShardedMap<K,V> items;
     QMap<K, QTimer*> timers;
+    ShardedMap<K, qint64> deadlines;
+
+    // Values loaded by loadMapped() stay serialized inside the mapping
+    // until first access and spilled values live in segment files until
+    // faulted back
+    ShardedMap<K, QByteArray> mapped;
+    QList<QSharedPointer<QFile>> mappedFiles;
+
+    QSharedPointer<SpillFile> spill;
+    ShardedMap<K, SpillFile::Location> spilled;
+    int residentLimit = 0;
+
+    // Sampled LRU: a hit only stores the clock into the entry's stamp,
+    // eviction spills the stalest of a few randomly picked resident keys.
+    // Slots are added and removed under the write lock only, and a deque
+    // never moves its stamps while growing
+    static constexpr int EvictionSamples = 8;
+    std::atomic<quint64> useClock{0};
+    QHash<K, int> usageSlots;
+    QVector<K> residentKeys;
+    std::deque<std::atomic<quint64>> usageStamps;
+    std::minstd_rand sampler;
+
+    QSharedPointer<Journal> journal;
+    QString journalSnapshotPath;
+    QTimer * compactionTimer = nullptr;
+
+    // Every recorded mutation is numbered, snapshots carry the number of
+    // the last mutation they include
+    MutationHandler mutationHandler = nullptr;
+    quint64 mutationSequence = 0;
+
+    RemovalHandler removalHandler = nullptr;
+
+    // Large QByteArray values are kept only in compressed form and
+    // decompressed on every read
+    ShardedMap<K, Packed> compressed;
+    Codec compressor;
+    Codec decompressor;
+    int compressionThreshold = 0;
+    CompressionStats compression;
+};
+
+template <class K, class V>
+class ExpiringStorage<K, V>::const_iterator {
+public:
+    const_iterator() = default;
+
+    const K & key() const { return *currentKey; }
+    const V & value() const { return currentValue; }
+    const V & operator*() const { return currentValue; }
+    const V * operator->() const { return &currentValue; }
+
+    const_iterator & operator++() {
+        advance();
+        return *this;
+    }
+
+    // Keys point into the snapshot, so equal positions share the pointer
+    bool operator==(const const_iterator & other) const {
+        return (snapshot == other.snapshot && (!snapshot || currentKey == other.currentKey));
+    }
+    bool operator!=(const const_iterator & other) const { return !(*this == other); }
+
+private:
+    friend class ExpiringStorage;
+
+    // Positions every map of the key's shard at the first key not less
+    // than the given one, the next advance() lands on it if it exists
+    inline const_iterator(const QSharedPointer<Snapshot> & source, int index, const K * from);
+    inline void advance();
+
+    QSharedPointer<Snapshot> snapshot;
+    int shard = 0;
+    typename QMap<K,V>::const_iterator itemIt;
+    typename QMap<K, QByteArray>::const_iterator mappedIt;
+    typename QMap<K, SpillFile::Location>::const_iterator spilledIt;
+    typename QMap<K, Packed>::const_iterator packedIt;
+
+    const K * currentKey = nullptr;
+    V currentValue;
 };
 
+template<class K, class V>
+ExpiringStorage<K, V>::const_iterator::const_iterator(const QSharedPointer<Snapshot> & source,
+                                                      int index,
+                                                      const K * from) :
+    snapshot(source),
+    shard(index)
+{
+    if (from) {
+        itemIt = snapshot->items.shard(shard).lowerBound(*from);
+        mappedIt = snapshot->mapped.shard(shard).lowerBound(*from);
+        spilledIt = snapshot->spilled.shard(shard).lowerBound(*from);
+        packedIt = snapshot->compressed.shard(shard).lowerBound(*from);
+    } else {
+        itemIt = snapshot->items.shard(shard).constBegin();
+        mappedIt = snapshot->mapped.shard(shard).constBegin();
+        spilledIt = snapshot->spilled.shard(shard).constBegin();
+        packedIt = snapshot->compressed.shard(shard).constBegin();
+    }
+    advance();
+}
+
+template<class K, class V>
+void ExpiringStorage<K, V>::const_iterator::advance()
+{
+    // Same per shard merge as forEachEntry(), one entry at a time
+    while (snapshot) {
+        const auto & residentShard = snapshot->items.shard(shard);
+        const auto & mappedShard = snapshot->mapped.shard(shard);
+        const auto & spilledShard = snapshot->spilled.shard(shard);
+        const auto & packedShard = snapshot->compressed.shard(shard);
+
+        const K * next = nullptr;
+        if (itemIt != residentShard.constEnd()) {
+            next = &itemIt.key();
+        }
+        if (mappedIt != mappedShard.constEnd() && (!next || mappedIt.key() < *next)) {
+            next = &mappedIt.key();
+        }
+        if (spilledIt != spilledShard.constEnd() && (!next || spilledIt.key() < *next)) {
+            next = &spilledIt.key();
+        }
+        if (packedIt != packedShard.constEnd() && (!next || packedIt.key() < *next)) {
+            next = &packedIt.key();
+        }
+
+        if (!next) {
+            if (++shard == ShardedMap<K,V>::ShardCount) {
+                snapshot.clear();
+                currentKey = nullptr;
+                return;
+            }
+
+            itemIt = snapshot->items.shard(shard).constBegin();
+            mappedIt = snapshot->mapped.shard(shard).constBegin();
+            spilledIt = snapshot->spilled.shard(shard).constBegin();
+            packedIt = snapshot->compressed.shard(shard).constBegin();
+            continue;
+        }
+
+        currentKey = next;
+        if (itemIt != residentShard.constEnd() && next == &itemIt.key()) {
+            currentValue = itemIt.value();
+            ++itemIt;
+            return;
+        }
+        if (mappedIt != mappedShard.constEnd() && next == &mappedIt.key()) {
+            currentValue = decode(mappedIt.value());
+            ++mappedIt;
+            return;
+        }
+        if (packedIt != packedShard.constEnd() && next == &packedIt.key()) {
+            currentValue = unpack(packedIt.value(), snapshot->decompressor);
+            ++packedIt;
+            return;
+        }
+
+        // Values that can't be read back from the spill are skipped
+        const SpillFile::Location & location = spilledIt.value();
+        ++spilledIt;
+
+        QByteArray encoded;
+        if (location.segment->read(location.offset, location.length, &encoded)) {
+            currentValue = decode(encoded);
+            return;
+        }
+    }
+}
+
 template <class K, class V>
 void ExpiringStorage<K, V>::insert(const K & key,
                                    const V & value,
                                    qint64 lifetimeMsec)
 {
     QWriteLocker locker(&mtx);
-    items.insert(key, value);
+    put(key, value, lifetimeMsec);
+}
+
+template <class K, class V>
+void ExpiringStorage<K, V>::replace(const K & key,
+                                    const V & value,
+                                    qint64 lifetimeMsec)
+{
+    QWriteLocker locker(&mtx);
+    if (lifetimeMsec <= 0) {
+        removeTimer(key);
+    }
+
+    put(key, value, lifetimeMsec);
+}
+
+template<class K, class V>
+bool ExpiringStorage<K, V>::setLifetime(const K & key, qint64 lifetimeMsec)
+{
+    QWriteLocker locker(&mtx);
+    if (!holds(key)) {
+        return false;
+    }
 
     if (lifetimeMsec > 0) {
         watch(key, lifetimeMsec);
+    } else {
+        removeTimer(key);
+    }
+
+    // Journal and replicas take the new deadline as a rewrite of the entry
+    if (journal || mutationHandler) {
+        auto packedIt = compressed.constFind(key);
+        if (packedIt != compressed.constEnd()) {
+            const V current = unpack(packedIt.value(), decompressor);
+            record(Operation::Insert, key, &current);
+        } else if (fault(key) || items.contains(key)) {
+            const V current = items.value(key);
+            record(Operation::Insert, key, &current);
+        }
+        shed();
     }
+    return true;
 }
 
 template<class K, class V>
@@ -71,7 +455,13 @@ bool ExpiringStorage<K, V>::remove(const K & key)
     QWriteLocker locker(&mtx);
 
     removeTimer(key);
-    return (items.remove(key) > 0);
+    if (!discard(key)) {
+        return false;
+    }
+
+    record(Operation::Remove, key);
+    notifyRemoved(key);
+    return true;
 }
 
 template<class K, class V>
@@ -79,36 +469,83 @@ V ExpiringStorage<K, V>::take(const K & key)
 {
     QWriteLocker locker(&mtx);
 
+    // An unreadable spilled value stays, and so do its timer and deadline
+    fault(key);
+    if (!items.contains(key)) {
+        return V();
+    }
+
     removeTimer(key);
+    record(Operation::Remove, key);
+    notifyRemoved(key);
+    forget(key);
+
     return items.take(key);
 }
 
 template<class K, class V>
 V ExpiringStorage<K, V>::value(const K & key, const V & defaultValue)
 {
-    QReadLocker locker(&mtx);
-    return items.value(key, defaultValue);
+    {
+        QReadLocker locker(&mtx);
+        auto it = items.constFind(key);
+        if (it != items.constEnd()) {
+            touch(key);
+            return it.value();
+        }
+
+        auto packedIt = compressed.constFind(key);
+        if (packedIt != compressed.constEnd()) {
+            return unpack(packedIt.value(), decompressor);
+        }
+
+        if (!mapped.contains(key) && !spilled.contains(key)) {
+            return defaultValue;
+        }
+    }
+
+    QWriteLocker locker(&mtx);
+    fault(key);
+    const V result = items.value(key, defaultValue);
+
+    shed();
+    return result;
 }
 
 template<class K, class V>
 QList<V> ExpiringStorage<K, V>::values()
 {
     QReadLocker locker(&mtx);
-    return items.values();
+    if (mapped.isEmpty() && spilled.isEmpty() && compressed.isEmpty()) {
+        return items.values();
+    }
+
+    // Parked values are decoded for the caller without becoming resident
+    QList<V> result;
+    result.reserve(items.size() + mapped.size() + spilled.size() + compressed.size());
+
+    Snapshot snapshot = share();
+    // Values of unreadable spill segments are left out
+    forEachEntry(snapshot, [&](const K &, const V * value, const QByteArray * encoded) -> void
+    {
+        result.append(value ? *value : decode(*encoded));
+    });
+
+    return result;
 }
 
 template<class K, class V>
 bool ExpiringStorage<K, V>::contains(const K & key)
 {
     QReadLocker locker(&mtx);
-    return items.contains(key);
+    return holds(key);
 }
 
 template<class K, class V>
 int ExpiringStorage<K, V>::size()
 {
     QReadLocker locker(&mtx);
-    return items.size();
+    return (items.size() + mapped.size() + spilled.size() + compressed.size());
 }
 
 template<class K, class V>
@@ -116,29 +553,51 @@ void ExpiringStorage<K, V>::clear()
 {
     QWriteLocker locker(&mtx);
 
-    for (const auto & key : timers.keys()) {
-        removeTimer(key);
-    }
-
-    items.clear();
+    dropAll();
+    record(Operation::Clear);
 }
 
 template<class K, class V>
-typename QMap<K,V>::const_iterator ExpiringStorage<K,V>::find(const K & key) const
+typename ExpiringStorage<K,V>::const_iterator ExpiringStorage<K,V>::find(const K & key) const
 {
-    return items.find(key);
+    auto entry = QSharedPointer<Snapshot>::create();
+
+    {
+        QReadLocker locker(&mtx);
+
+        auto it = items.constFind(key);
+        auto packedIt = compressed.constFind(key);
+        auto mappedIt = mapped.constFind(key);
+        auto spilledIt = spilled.constFind(key);
+        QByteArray encoded;
+
+        if (it != items.constEnd()) {
+            entry->items.insert(key, it.value());
+        } else if (packedIt != compressed.constEnd()) {
+            entry->items.insert(key, unpack(packedIt.value(), decompressor));
+        } else if (mappedIt != mapped.constEnd()) {
+            entry->items.insert(key, decode(mappedIt.value()));
+        } else if (spilledIt != spilled.constEnd() && spill->read(spilledIt.value(), &encoded)) {
+            entry->items.insert(key, decode(encoded));
+        } else {
+            return const_iterator();
+        }
+    }
+
+    return const_iterator(entry, ShardedMap<K,V>::shardOf(key), nullptr);
 }
 
 template<class K, class V>
-typename QMap<K,V>::const_iterator ExpiringStorage<K,V>::begin() const
+typename ExpiringStorage<K,V>::const_iterator ExpiringStorage<K,V>::begin() const
 {
-    return items.begin();
+    QReadLocker locker(&mtx);
+    return const_iterator(QSharedPointer<Snapshot>::create(share()), 0, nullptr);
 }
 
 template<class K, class V>
-typename QMap<K,V>::const_iterator ExpiringStorage<K,V>::end() const
+typename ExpiringStorage<K,V>::const_iterator ExpiringStorage<K,V>::end() const
 {
-    return items.end();
+    return const_iterator();
 }
 
 template<class K, class V>
@@ -149,53 +608,1227 @@ void ExpiringStorage<K, V>::installExpirationHandler(Handler handler)
 }
 
 template<class K, class V>
-void ExpiringStorage<K, V>::watch(const K & key, qint64 lifetimeMsec)
+void ExpiringStorage<K, V>::installMutationHandler(MutationHandler handler)
 {
-    auto timerIt = timers.find(key);
-    if (timerIt == timers.end()) {
-        timerIt = timers.insert(key, createTimer(key));
+    QWriteLocker locker(&mtx);
+    mutationHandler = handler;
+}
+
+template<class K, class V>
+void ExpiringStorage<K, V>::installRemovalHandler(RemovalHandler handler)
+{
+    QWriteLocker locker(&mtx);
+    removalHandler = handler;
+}
+
+template<class K, class V>
+bool ExpiringStorage<K, V>::apply(const QByteArray & mutation)
+{
+    QWriteLocker locker(&mtx);
+    return replay(mutation);
+}
+
+template<class K, class V>
+bool ExpiringStorage<K, V>::save(const QString & path)
+{
+    return writeSnapshot(path, capture());
+}
+
+template<class K, class V>
+bool ExpiringStorage<K, V>::save(QIODevice * device)
+{
+    return writeSnapshot(device, capture());
+}
+
+template<class K, class V>
+bool ExpiringStorage<K, V>::save(QIODevice * device, quint64 * sequence)
+{
+    Snapshot snapshot = capture();
+    *sequence = snapshot.sequence;
+    return writeSnapshot(device, std::move(snapshot));
+}
+
+template<class K, class V>
+bool ExpiringStorage<K, V>::load(const QString & path)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
     }
 
-    QMetaObject::invokeMethod(timerIt.value(),
-                              "start",
-                              Qt::QueuedConnection,
-                              Q_ARG(int, int(lifetimeMsec)));
+    return load(&file);
 }
 
 template<class K, class V>
-QTimer * ExpiringStorage<K, V>::createTimer(const K & key)
+bool ExpiringStorage<K, V>::load(QIODevice * device)
 {
-    auto * timer = new QTimer;
-    timer->moveToThread(ctx.thread());
-    timer->setSingleShot(true);
+    ShardedMap<K,V> loaded;
+    ShardedMap<K,qint64> loadedDeadlines;
+    if (!readSnapshot(device, &loaded, &loadedDeadlines)) {
+        return false;
+    }
 
-    QObject::connect(timer, &QTimer::timeout, &ctx, [this, key]() -> void
-    {
-        mtx.lockForWrite();
+    QWriteLocker locker(&mtx);
 
-        const auto & value = items.take(key);
-        removeTimer(key);
+    // A replaced key loses its old timer and deadline, so it can't expire
+    // on the ones of the value it replaced
+    const bool parked = (!mapped.isEmpty() || !spilled.isEmpty() || !compressed.isEmpty());
+    const bool timed = !timers.isEmpty();
+    if (parked || timed) {
+        for (auto it = loaded.constBegin(); it != loaded.constEnd(); ++it) {
+            if (timed) {
+                removeTimer(it.key());
+            }
+            if (parked) {
+                dropParked(it.key());
+            }
+        }
+    }
 
-        mtx.unlock();
+    install(loaded, loadedDeadlines);
+    return true;
+}
 
-        if (expirationHandler) {
-            expirationHandler(key, value);
+template<class K, class V>
+bool ExpiringStorage<K, V>::reload(QIODevice * device)
+{
+    ShardedMap<K,V> loaded;
+    ShardedMap<K,qint64> loadedDeadlines;
+    if (!readSnapshot(device, &loaded, &loadedDeadlines)) {
+        return false;
+    }
+
+    QWriteLocker locker(&mtx);
+
+    QList<K> departed;
+    if (journal || mutationHandler || removalHandler) {
+        const auto collect = [&](const K & key) -> void {
+            if (!loaded.contains(key)) {
+                departed.append(key);
+            }
+        };
+        for (auto it = items.constBegin(); it != items.constEnd(); ++it) {
+            collect(it.key());
         }
-    });
+        for (auto it = mapped.constBegin(); it != mapped.constEnd(); ++it) {
+            collect(it.key());
+        }
+        for (auto it = spilled.constBegin(); it != spilled.constEnd(); ++it) {
+            collect(it.key());
+        }
+        for (auto it = compressed.constBegin(); it != compressed.constEnd(); ++it) {
+            collect(it.key());
+        }
+    }
 
-    return timer;
+    dropAll(false);
+    for (const auto & key : departed) {
+        record(Operation::Remove, key);
+        notifyRemoved(key);
+    }
+
+    install(loaded, loadedDeadlines);
+    return true;
 }
 
 template<class K, class V>
-void ExpiringStorage<K,V>::removeTimer(const K & key)
+bool ExpiringStorage<K, V>::saveMapped(const QString & path)
 {
-    auto * timerObject = timers.take(key);
-    if (timerObject)
+    return writeMappedSnapshot(path, capture());
+}
+
+template<class K, class V>
+bool ExpiringStorage<K, V>::loadMapped(const QString & path)
+{
+    static constexpr qint64 HeaderSize = sizeof(quint32) + sizeof(quint16);
+    static constexpr qint64 TrailerSize = sizeof(qint64);
+
+    auto file = QSharedPointer<QFile>::create(path);
+    if (!file->open(QIODevice::ReadOnly)) {
+        return false;
+    }
+
+    const qint64 fileSize = file->size();
+    if (fileSize < HeaderSize + TrailerSize) {
+        return false;
+    }
+
+    const auto * base = reinterpret_cast<const char *>(file->map(0, fileSize));
+    if (!base) {
+        return false;
+    }
+
+    quint32 magic = 0;
+    quint16 version = 0;
+    QDataStream header(QByteArray::fromRawData(base, int(HeaderSize)));
+    header.setVersion(QDataStream::Qt_5_6);
+    header >> magic >> version;
+
+    if (magic != MappedSnapshotMagic || version != SnapshotVersion) {
+        return false;
+    }
+
+    qint64 indexOffset = 0;
+    QDataStream trailer(QByteArray::fromRawData(base + fileSize - TrailerSize, int(TrailerSize)));
+    trailer.setVersion(QDataStream::Qt_5_6);
+    trailer >> indexOffset;
+
+    if (indexOffset < HeaderSize || indexOffset > fileSize - TrailerSize) {
+        return false;
+    }
+
+    const int indexSize = int(fileSize - TrailerSize - indexOffset);
+    QDataStream index(QByteArray::fromRawData(base + indexOffset, indexSize));
+    index.setVersion(QDataStream::Qt_5_6);
+
+    quint64 count = 0;
+    index >> count;
+
+    const qint64 loadedAt = now();
+    ShardedMap<K, QByteArray> loaded;
+    ShardedMap<K, qint64> loadedDeadlines;
+
+    for (quint64 i = 0; i < count && index.status() == QDataStream::Ok; ++i) {
+        K key;
+        qint64 deadline = 0;
+        qint64 offset = 0;
+        qint64 length = 0;
+        index >> key >> deadline >> offset >> length;
+
+        if (offset < HeaderSize || length < 0 || offset + length > indexOffset) {
+            return false;
+        }
+
+        if (deadline > 0 && deadline <= loadedAt) {
+            continue;
+        }
+
+        loaded.append(key, QByteArray::fromRawData(base + offset, int(length)));
+        if (deadline > 0) {
+            loadedDeadlines.append(key, deadline);
+        }
+    }
+
+    if (index.status() != QDataStream::Ok) {
+        return false;
+    }
+
+    QWriteLocker locker(&mtx);
+    for (auto it = loaded.constBegin(); it != loaded.constEnd(); ++it) {
+        removeTimer(it.key());
+        discard(it.key());
+        mapped.insert(it.key(), it.value());
+    }
+    mappedFiles.append(file);
+
+    const qint64 current = now();
+    for (auto it = loadedDeadlines.constBegin(); it != loadedDeadlines.constEnd(); ++it) {
+        watch(it.key(), qMax<qint64>(1, it.value() - current));
+    }
+
+    if (journal || mutationHandler) {
+        for (auto it = loaded.constBegin(); it != loaded.constEnd(); ++it) {
+            record(Operation::Insert, it.key(), nullptr, &it.value());
+        }
+    }
+
+    return true;
+}
+
+template<class K, class V>
+std::future<bool> ExpiringStorage<K, V>::saveInBackground(const QString & path)
+{
+    std::packaged_task<bool()> task([snapshot = capture(), path]() mutable -> bool
     {
-        QMetaObject::invokeMethod(timerObject,
-                                  "deleteLater",
-                                  Qt::QueuedConnection);
+        return writeSnapshot(path, std::move(snapshot));
+    });
+
+    auto result = task.get_future();
+    std::thread(std::move(task)).detach();
+    return result;
+}
+
+template<class K, class V>
+bool ExpiringStorage<K, V>::openJournal(const QString & path,
+                                        const QString & snapshotPath,
+                                        const Journal::Options & options)
+{
+    auto opened = QSharedPointer<Journal>::create(path, options);
+    if (!opened->open()) {
+        return false;
+    }
+
+    QWriteLocker locker(&mtx);
+    journal.swap(opened);
+    journalSnapshotPath = snapshotPath;
+    scheduleCompaction(options.compactIntervalMsec);
+    locker.unlock();
+
+    if (opened) {
+        opened->close();
+    }
+    return true;
+}
+
+template<class K, class V>
+void ExpiringStorage<K, V>::closeJournal()
+{
+    QWriteLocker locker(&mtx);
+    auto closed = journal;
+    journal.clear();
+    scheduleCompaction(0);
+    locker.unlock();
+
+    if (closed) {
+        closed->close();
     }
 }
 
+template<class K, class V>
+bool ExpiringStorage<K, V>::syncJournal()
+{
+    QReadLocker locker(&mtx);
+    auto target = journal;
+    locker.unlock();
+
+    return (target && target->sync());
+}
+
+template<class K, class V>
+std::future<bool> ExpiringStorage<K, V>::compactJournal()
+{
+    QReadLocker locker(&mtx);
+    return startCompaction();
+}
+
+template<class K, class V>
+bool ExpiringStorage<K, V>::restore(const QString & snapshotPath, const QString & journalPath)
+{
+    if (QFile::exists(snapshotPath) && !load(snapshotPath)) {
+        return false;
+    }
+
+    QWriteLocker locker(&mtx);
+    const auto visitor = [this](const QByteArray & bytes) -> void { replay(bytes); };
+
+    return (Journal::replay(Journal::previousPath(journalPath), visitor)
+            && Journal::replay(journalPath, visitor));
+}
+
+template<class K, class V>
+bool ExpiringStorage<K, V>::enableSpill(const QString & directory,
+                                        int maxResidentItems,
+                                        qint64 segmentBytes)
+{
+    if (!QDir().mkpath(directory)) {
+        return false;
+    }
+
+    QWriteLocker locker(&mtx);
+    if (!spill) {
+        spill = QSharedPointer<SpillFile>::create(directory, segmentBytes);
+        for (auto it = items.constBegin(); it != items.constEnd(); ++it) {
+            track(it.key());
+        }
+    }
+
+    residentLimit = maxResidentItems;
+    shed();
+    return true;
+}
+
+template<class K, class V>
+void ExpiringStorage<K, V>::compactSpill()
+{
+    QWriteLocker locker(&mtx);
+    compactSegments();
+}
+
+template<class K, class V>
+void ExpiringStorage<K, V>::enableCompression(int thresholdBytes,
+                                              Codec compressor,
+                                              Codec decompressor)
+{
+    static_assert(std::is_same<V, QByteArray>::value,
+                  "Compression is only available for QByteArray values");
+
+    QWriteLocker locker(&mtx);
+    compressionThreshold = thresholdBytes;
+
+    if (compressor && decompressor) {
+        this->compressor = compressor;
+        this->decompressor = decompressor;
+    } else {
+        this->compressor = [](const QByteArray & raw) -> QByteArray { return qCompress(raw); };
+        this->decompressor = [](const QByteArray & data) -> QByteArray { return qUncompress(data); };
+    }
+}
+
+template<class K, class V>
+typename ExpiringStorage<K, V>::CompressionStats ExpiringStorage<K, V>::compressionStats()
+{
+    QReadLocker locker(&mtx);
+    return compression;
+}
+
+template<class K, class V>
+qint64 ExpiringStorage<K, V>::now()
+{
+    return QDateTime::currentMSecsSinceEpoch();
+}
+
+template<class K, class V>
+QByteArray ExpiringStorage<K, V>::encode(const V & value)
+{
+    QByteArray encoded;
+    QDataStream stream(&encoded, QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_5_6);
+
+    stream << value;
+    return encoded;
+}
+
+template<class K, class V>
+V ExpiringStorage<K, V>::decode(const QByteArray & encoded)
+{
+    QDataStream stream(encoded);
+    stream.setVersion(QDataStream::Qt_5_6);
+
+    V value;
+    stream >> value;
+    return value;
+}
+
+template<class K, class V>
+typename ExpiringStorage<K, V>::Snapshot ExpiringStorage<K, V>::capture()
+{
+    QReadLocker locker(&mtx);
+    return share();
+}
+
+template<class K, class V>
+typename ExpiringStorage<K, V>::Snapshot ExpiringStorage<K, V>::share() const
+{
+    return Snapshot{items, mapped, deadlines, mappedFiles, spilled, compressed, decompressor, mutationSequence};
+}
+
+template<class K, class V>
+bool ExpiringStorage<K, V>::writeSnapshot(QIODevice * device, Snapshot snapshot)
+{
+    QDataStream stream(device);
+    stream.setVersion(QDataStream::Qt_5_6);
+    stream << SnapshotMagic
+           << SnapshotVersion
+           << quint64(snapshot.items.size()
+                      + snapshot.mapped.size()
+                      + snapshot.spilled.size()
+                      + snapshot.compressed.size());
+
+    const bool complete = forEachEntry(snapshot, [&](const K & key, const V * value, const QByteArray * encoded) -> void
+    {
+        stream << key << snapshot.deadlines.value(key, 0);
+        writeValue(stream, value, encoded);
+    });
+
+    return (complete && stream.status() == QDataStream::Ok);
+}
+
+template<class K, class V>
+bool ExpiringStorage<K, V>::writeSnapshot(const QString & path, Snapshot snapshot)
+{
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+
+    if (!writeSnapshot(&file, std::move(snapshot))) {
+        file.cancelWriting();
+        return false;
+    }
+
+    return file.commit();
+}
+
+template<class K, class V>
+bool ExpiringStorage<K, V>::writeMappedSnapshot(const QString & path, Snapshot snapshot)
+{
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_6);
+    stream << MappedSnapshotMagic << SnapshotVersion;
+
+    // Values go first so that their offsets are known when the index
+    // is written; the index offset is stored in the last 8 bytes
+    const int count = snapshot.items.size()
+                    + snapshot.mapped.size()
+                    + snapshot.spilled.size()
+                    + snapshot.compressed.size();
+    QList<K> keys;
+    QList<qint64> expiries;
+    QList<QPair<qint64,qint64>> extents;
+    keys.reserve(count);
+    expiries.reserve(count);
+    extents.reserve(count);
+
+    const bool complete = forEachEntry(snapshot, [&](const K & key, const V * value, const QByteArray * encoded) -> void
+    {
+        const qint64 offset = file.pos();
+        writeValue(stream, value, encoded);
+
+        keys.append(key);
+        expiries.append(snapshot.deadlines.value(key, 0));
+        extents.append(qMakePair(offset, file.pos() - offset));
+    });
+
+    const qint64 indexOffset = file.pos();
+    stream << quint64(keys.size());
+    for (int i = 0; i < keys.size(); ++i) {
+        stream << keys.at(i)
+               << expiries.at(i)
+               << extents.at(i).first
+               << extents.at(i).second;
+    }
+    stream << indexOffset;
+
+    if (!complete || stream.status() != QDataStream::Ok) {
+        file.cancelWriting();
+        return false;
+    }
+
+    return file.commit();
+}
+
+template<class K, class V>
+bool ExpiringStorage<K, V>::readSnapshot(QIODevice * device,
+                                         ShardedMap<K,V> * loaded,
+                                         ShardedMap<K,qint64> * loadedDeadlines)
+{
+    QDataStream stream(device);
+    stream.setVersion(QDataStream::Qt_5_6);
+
+    quint32 magic = 0;
+    quint16 version = 0;
+    quint64 count = 0;
+    stream >> magic >> version >> count;
+
+    if (magic != SnapshotMagic || version != SnapshotVersion) {
+        return false;
+    }
+
+    // Entries are stored shard by shard in key order, so appending with
+    // an end() hint builds the maps without a lookup per entry
+    const qint64 loadedAt = now();
+
+    for (quint64 i = 0; i < count && stream.status() == QDataStream::Ok; ++i) {
+        K key;
+        qint64 deadline = 0;
+        V value;
+        stream >> key >> deadline >> value;
+
+        if (deadline > 0 && deadline <= loadedAt) {
+            continue;
+        }
+
+        loaded->append(key, value);
+        if (deadline > 0) {
+            loadedDeadlines->append(key, deadline);
+        }
+    }
+
+    return (stream.status() == QDataStream::Ok);
+}
+
+template<class K, class V>
+template<class Visitor>
+bool ExpiringStorage<K, V>::forEachEntry(Snapshot & snapshot, Visitor visitor)
+{
+    enum Source { Resident, Mapped, Spilled, Compressed };
+    bool complete = true;
+
+    // A key lives in exactly one of the maps and all of them shard keys
+    // the same way, so each shard is merged on its own in key order
+    for (int shard = 0; shard < ShardedMap<K,V>::ShardCount; ++shard) {
+        const auto & residentShard = snapshot.items.shard(shard);
+        const auto & mappedShard = snapshot.mapped.shard(shard);
+        const auto & spilledShard = snapshot.spilled.shard(shard);
+        const auto & packedShard = snapshot.compressed.shard(shard);
+
+        auto itemIt = residentShard.constBegin();
+        auto mappedIt = mappedShard.constBegin();
+        auto spilledIt = spilledShard.constBegin();
+        auto packedIt = packedShard.constBegin();
+
+        while (true) {
+            const K * next = nullptr;
+            Source source = Resident;
+
+            if (itemIt != residentShard.constEnd()) {
+                next = &itemIt.key();
+            }
+            if (mappedIt != mappedShard.constEnd() && (!next || mappedIt.key() < *next)) {
+                next = &mappedIt.key();
+                source = Mapped;
+            }
+            if (spilledIt != spilledShard.constEnd() && (!next || spilledIt.key() < *next)) {
+                next = &spilledIt.key();
+                source = Spilled;
+            }
+            if (packedIt != packedShard.constEnd() && (!next || packedIt.key() < *next)) {
+                next = &packedIt.key();
+                source = Compressed;
+            }
+
+            if (!next) {
+                break;
+            }
+
+            switch (source) {
+            case Resident:
+                visitor(itemIt.key(), &itemIt.value(), nullptr);
+                ++itemIt;
+                break;
+            case Mapped:
+                visitor(mappedIt.key(), nullptr, &mappedIt.value());
+                ++mappedIt;
+                break;
+            case Spilled: {
+                const auto & location = spilledIt.value();
+                QByteArray encoded;
+                if (location.segment->read(location.offset, location.length, &encoded)) {
+                    visitor(spilledIt.key(), nullptr, &encoded);
+                } else {
+                    complete = false;
+                }
+                ++spilledIt;
+                break;
+            }
+            case Compressed: {
+                const V value = unpack(packedIt.value(), snapshot.decompressor);
+                visitor(packedIt.key(), &value, nullptr);
+                ++packedIt;
+                break;
+            }
+            }
+        }
+
+        snapshot.items.release(shard);
+        snapshot.mapped.release(shard);
+        snapshot.spilled.release(shard);
+        snapshot.compressed.release(shard);
+        snapshot.deadlines.release(shard);
+    }
+
+    return complete;
+}
+
+template<class K, class V>
+void ExpiringStorage<K, V>::writeValue(QDataStream & stream,
+                                       const V * value,
+                                       const QByteArray * encoded)
+{
+    if (value) {
+        stream << *value;
+    } else {
+        stream.writeRawData(encoded->constData(), encoded->size());
+    }
+}
+
+template<class K, class V>
+void ExpiringStorage<K, V>::install(const ShardedMap<K,V> & loaded, const ShardedMap<K,qint64> & loadedDeadlines)
+{
+    if (items.isEmpty() && !compressor && !spill) {
+        items = loaded;
+    } else {
+        for (auto it = loaded.constBegin(); it != loaded.constEnd(); ++it) {
+            Packed packed;
+            if (pack(it.value(), &packed)) {
+                discard(it.key());
+                addPacked(it.key(), packed);
+            } else {
+                items.insert(it.key(), it.value());
+                track(it.key());
+            }
+        }
+    }
+
+    const qint64 current = now();
+    for (auto it = loadedDeadlines.constBegin(); it != loadedDeadlines.constEnd(); ++it) {
+        watch(it.key(), qMax<qint64>(1, it.value() - current));
+    }
+
+    // Journal and replicas see a load as the inserts it amounts to
+    if (journal || mutationHandler) {
+        for (auto it = loaded.constBegin(); it != loaded.constEnd(); ++it) {
+            record(Operation::Insert, it.key(), &it.value());
+        }
+    }
+
+    shed();
+}
+
+template<class K, class V>
+void ExpiringStorage<K, V>::put(const K & key, const V & value, qint64 lifetimeMsec)
+{
+    Packed packed;
+    if (pack(value, &packed)) {
+        discard(key);
+        addPacked(key, packed);
+    } else {
+        items.insert(key, value);
+        dropParked(key);
+        track(key);
+    }
+
+    if (lifetimeMsec > 0) {
+        watch(key, lifetimeMsec);
+    }
+
+    record(Operation::Insert, key, &value);
+    shed();
+}
+
+template<class K, class V>
+bool ExpiringStorage<K, V>::holds(const K & key) const
+{
+    return (items.contains(key)
+            || mapped.contains(key)
+            || spilled.contains(key)
+            || compressed.contains(key));
+}
+
+template<class K, class V>
+bool ExpiringStorage<K, V>::fault(const K & key)
+{
+    auto packedIt = compressed.constFind(key);
+    if (packedIt != compressed.constEnd()) {
+        items.insert(key, unpack(packedIt.value(), decompressor));
+        dropParked(key);
+        return true;
+    }
+
+    auto mappedIt = mapped.constFind(key);
+    if (mappedIt != mapped.constEnd()) {
+        items.insert(key, decode(mappedIt.value()));
+        mapped.remove(key);
+
+        if (mapped.isEmpty()) {
+            mappedFiles.clear();
+        }
+
+        track(key);
+        return true;
+    }
+
+    auto spilledIt = spilled.constFind(key);
+    if (spilledIt == spilled.constEnd()) {
+        return false;
+    }
+
+    // An unreadable value stays spilled, the key reads as missing
+    const SpillFile::Location location = spilledIt.value();
+    QByteArray encoded;
+    if (!spill->read(location, &encoded)) {
+        return false;
+    }
+
+    items.insert(key, decode(encoded));
+    spill->release(location);
+    spilled.remove(key);
+
+    track(key);
+    return true;
+}
+
+template<class K, class V>
+bool ExpiringStorage<K, V>::discard(const K & key)
+{
+    const bool resident = (items.remove(key) > 0);
+    if (resident) {
+        forget(key);
+    }
+
+    return (dropParked(key) || resident);
+}
+
+template<class K, class V>
+bool ExpiringStorage<K, V>::dropParked(const K & key)
+{
+    auto packedIt = compressed.constFind(key);
+    if (packedIt != compressed.constEnd()) {
+        compression.rawBytes -= packedIt.value().rawSize;
+        compression.compressedBytes -= packedIt.value().data.size();
+        compression.entries -= 1;
+
+        compressed.remove(key);
+        return true;
+    }
+
+    if (mapped.remove(key) > 0) {
+        if (mapped.isEmpty()) {
+            mappedFiles.clear();
+        }
+        return true;
+    }
+
+    auto spilledIt = spilled.constFind(key);
+    if (spilledIt == spilled.constEnd()) {
+        return false;
+    }
+
+    spill->release(spilledIt.value());
+    spilled.remove(key);
+    return true;
+}
+
+template<class K, class V>
+void ExpiringStorage<K, V>::dropAll(bool notify)
+{
+    for (const auto & key : timers.keys()) {
+        removeTimer(key);
+    }
+
+    if (removalHandler && notify) {
+        for (auto it = items.constBegin(); it != items.constEnd(); ++it) {
+            removalHandler(it.key());
+        }
+        for (auto it = mapped.constBegin(); it != mapped.constEnd(); ++it) {
+            removalHandler(it.key());
+        }
+        for (auto it = spilled.constBegin(); it != spilled.constEnd(); ++it) {
+            removalHandler(it.key());
+        }
+        for (auto it = compressed.constBegin(); it != compressed.constEnd(); ++it) {
+            removalHandler(it.key());
+        }
+    }
+
+    for (auto it = spilled.constBegin(); it != spilled.constEnd(); ++it) {
+        spill->release(it.value());
+    }
+
+    items.clear();
+    mapped.clear();
+    mappedFiles.clear();
+    spilled.clear();
+    compressed.clear();
+    compression = CompressionStats();
+
+    usageSlots.clear();
+    residentKeys.clear();
+    usageStamps.clear();
+}
+
+template<class K, class V>
+void ExpiringStorage<K, V>::notifyRemoved(const K & key)
+{
+    if (removalHandler) {
+        removalHandler(key);
+    }
+}
+
+template<class K, class V>
+bool ExpiringStorage<K, V>::pack(const V & value, Packed * packed) const
+{
+    if constexpr (std::is_same<V, QByteArray>::value) {
+        if (!compressor || value.size() < compressionThreshold) {
+            return false;
+        }
+
+        // Incompressible payloads stay as they are
+        packed->data = compressor(value);
+        packed->rawSize = value.size();
+        return (packed->data.size() < value.size());
+    } else {
+        Q_UNUSED(value)
+        Q_UNUSED(packed)
+        return false;
+    }
+}
+
+template<class K, class V>
+V ExpiringStorage<K, V>::unpack(const Packed & packed, const Codec & decompressor)
+{
+    if constexpr (std::is_same<V, QByteArray>::value) {
+        return decompressor(packed.data);
+    } else {
+        Q_UNUSED(packed)
+        Q_UNUSED(decompressor)
+        return V();
+    }
+}
+
+template<class K, class V>
+void ExpiringStorage<K, V>::addPacked(const K & key, const Packed & packed)
+{
+    compressed.insert(key, packed);
+
+    compression.rawBytes += packed.rawSize;
+    compression.compressedBytes += packed.data.size();
+    compression.entries += 1;
+}
+
+template<class K, class V>
+void ExpiringStorage<K, V>::track(const K & key)
+{
+    if (!spill) {
+        return;
+    }
+
+    // Write lock only, a new key takes the next slot
+    if (!usageSlots.contains(key)) {
+        usageSlots.insert(key, residentKeys.size());
+        residentKeys.append(key);
+        usageStamps.emplace_back(0);
+    }
+    touch(key);
+}
+
+template<class K, class V>
+void ExpiringStorage<K, V>::touch(const K & key)
+{
+    if (!spill) {
+        return;
+    }
+
+    // Safe under the read lock: the slot table doesn't change and a
+    // racing store of the same clock value doesn't matter
+    auto it = usageSlots.constFind(key);
+    if (it != usageSlots.constEnd()) {
+        usageStamps[size_t(it.value())].store(useClock.load(std::memory_order_relaxed),
+                                              std::memory_order_relaxed);
+    }
+}
+
+template<class K, class V>
+void ExpiringStorage<K, V>::forget(const K & key)
+{
+    if (!spill || !usageSlots.contains(key)) {
+        return;
+    }
+
+    // The last slot moves into the freed one
+    const int slot = usageSlots.take(key);
+    const int last = residentKeys.size() - 1;
+    if (slot != last) {
+        residentKeys[slot] = residentKeys.at(last);
+        usageStamps[size_t(slot)].store(usageStamps[size_t(last)].load(std::memory_order_relaxed),
+                                        std::memory_order_relaxed);
+        usageSlots.insert(residentKeys.at(slot), slot);
+    }
+
+    residentKeys.removeLast();
+    usageStamps.pop_back();
+}
+
+template<class K, class V>
+void ExpiringStorage<K, V>::shed()
+{
+    if (!spill) {
+        return;
+    }
+
+    // The clock only moves on writes, hits between two writes share a
+    // stamp and are equally recent
+    useClock.fetch_add(1, std::memory_order_relaxed);
+
+    while (items.size() > residentLimit && !residentKeys.isEmpty()) {
+        std::uniform_int_distribution<int> pick(0, residentKeys.size() - 1);
+        int victim = pick(sampler);
+        for (int i = 1; i < EvictionSamples; ++i) {
+            const int candidate = pick(sampler);
+            if (usageStamps[size_t(candidate)].load(std::memory_order_relaxed)
+                    < usageStamps[size_t(victim)].load(std::memory_order_relaxed)) {
+                victim = candidate;
+            }
+        }
+
+        const K key = residentKeys.at(victim);
+        auto itemIt = items.constFind(key);
+        if (itemIt == items.constEnd()) {
+            forget(key);
+            continue;
+        }
+
+        SpillFile::Location location;
+        if (!spill->append(encode(itemIt.value()), &location)) {
+            break;
+        }
+
+        forget(key);
+        items.remove(key);
+        spilled.insert(key, location);
+    }
+
+    if (spill->takeRollover()) {
+        compactSegments();
+    }
+}
+
+template<class K, class V>
+void ExpiringStorage<K, V>::compactSegments()
+{
+    if (!spill) {
+        return;
+    }
+
+    // Segments that are mostly expired or faulted back get their live
+    // values copied to the active segment and are then dropped
+    const auto sparse = spill->sparseSegments(0.5);
+    if (sparse.isEmpty()) {
+        return;
+    }
+
+    // Collected first, so only the shards holding moved values detach
+    // from a snapshot that is still being written
+    QList<QPair<K, SpillFile::Location>> moving;
+    for (auto it = spilled.constBegin(); it != spilled.constEnd(); ++it) {
+        if (sparse.contains(it.value().segment)) {
+            moving.append(qMakePair(it.key(), it.value()));
+        }
+    }
+
+    for (const auto & entry : moving) {
+        QByteArray encoded;
+        SpillFile::Location moved;
+        if (spill->read(entry.second, &encoded) && spill->append(encoded, &moved)) {
+            spill->release(entry.second);
+            spilled.insert(entry.first, moved);
+        }
+    }
+
+    for (const auto & segment : sparse) {
+        spill->retire(segment);
+    }
+    spill->takeRollover();
+}
+
+template<class K, class V>
+void ExpiringStorage<K, V>::record(Operation operation,
+                                   const K & key,
+                                   const V * value,
+                                   const QByteArray * encoded)
+{
+    if (!journal && !mutationHandler) {
+        return;
+    }
+
+    QByteArray bytes;
+    QDataStream stream(&bytes, QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_5_6);
+    stream << quint8(operation);
+
+    if (operation != Operation::Clear) {
+        stream << key;
+    }
+    if (operation == Operation::Insert) {
+        stream << deadlines.value(key, 0);
+        writeValue(stream, value, encoded);
+    }
+
+    if (mutationHandler) {
+        mutationHandler(++mutationSequence, bytes);
+    }
+    if (!journal) {
+        return;
+    }
+
+    const qint64 threshold = journal->options().compactBytes;
+    if (journal->append(bytes) >= threshold && threshold > 0) {
+        startCompaction();
+    }
+}
+
+template<class K, class V>
+bool ExpiringStorage<K, V>::replay(const QByteArray & record)
+{
+    QDataStream stream(record);
+    stream.setVersion(QDataStream::Qt_5_6);
+
+    quint8 operation = 0;
+    stream >> operation;
+
+    if (Operation(operation) == Operation::Clear) {
+        dropAll();
+        return true;
+    }
+    if (Operation(operation) != Operation::Insert && Operation(operation) != Operation::Remove) {
+        return false;
+    }
+
+    K key;
+    qint64 deadline = 0;
+    V value;
+    stream >> key;
+    if (Operation(operation) == Operation::Insert) {
+        stream >> deadline >> value;
+    }
+
+    if (stream.status() != QDataStream::Ok) {
+        return false;
+    }
+
+    removeTimer(key);
+    if (discard(key) && Operation(operation) == Operation::Remove) {
+        notifyRemoved(key);
+    }
+
+    const qint64 current = now();
+    if (Operation(operation) != Operation::Insert || (deadline > 0 && deadline <= current)) {
+        return true;
+    }
+
+    Packed packed;
+    if (pack(value, &packed)) {
+        addPacked(key, packed);
+    } else {
+        items.insert(key, value);
+        track(key);
+    }
+
+    if (deadline > 0) {
+        watch(key, deadline - current);
+    }
+
+    shed();
+    return true;
+}
+
+template<class K, class V>
+std::future<bool> ExpiringStorage<K, V>::startCompaction()
+{
+    if (!journal || !journal->tryBeginCompaction()) {
+        std::promise<bool> skipped;
+        skipped.set_value(false);
+        return skipped.get_future();
+    }
+
+    // Rotating under the lock puts every record up to this snapshot into
+    // the previous journal file, which is dropped once the snapshot is durable
+    std::packaged_task<bool()> task([snapshot = share(),
+                                     rotated = journal->rotate().share(),
+                                     target = journal,
+                                     path = journalSnapshotPath]() mutable -> bool
+    {
+        const bool succeeded = (rotated.get() && writeSnapshot(path, std::move(snapshot)));
+        target->endCompaction(succeeded);
+        return succeeded;
+    });
+
+    auto result = task.get_future();
+    std::thread(std::move(task)).detach();
+    return result;
+}
+
+template<class K, class V>
+void ExpiringStorage<K, V>::scheduleCompaction(qint64 intervalMsec)
+{
+    if (compactionTimer) {
+        QMetaObject::invokeMethod(compactionTimer, "deleteLater", Qt::QueuedConnection);
+        compactionTimer = nullptr;
+    }
+    if (intervalMsec <= 0) {
+        return;
+    }
+
+    compactionTimer = new QTimer;
+    compactionTimer->moveToThread(ctx.thread());
+
+    // A journal that hasn't grown since the last rotation has nothing
+    // to compact
+    QObject::connect(compactionTimer, &QTimer::timeout, &ctx, [this]() -> void
+    {
+        QReadLocker locker(&mtx);
+        if (journal && journal->size() > 0) {
+            startCompaction();
+        }
+    });
+
+    arm(compactionTimer, intervalMsec);
+}
+
+template<class K, class V>
+void ExpiringStorage<K, V>::watch(const K & key, qint64 lifetimeMsec)
+{
+    deadlines.insert(key, now() + lifetimeMsec);
+
+    auto timerIt = timers.find(key);
+    if (timerIt == timers.end()) {
+        timerIt = timers.insert(key, createTimer(key));
+    }
+
+    arm(timerIt.value(), lifetimeMsec);
+}
+
+template<class K, class V>
+QTimer * ExpiringStorage<K, V>::createTimer(const K & key)
+{
+    auto * timer = new QTimer;
+    timer->moveToThread(ctx.thread());
+    timer->setSingleShot(true);
+
+    QObject::connect(timer, &QTimer::timeout, &ctx, [this, key]() -> void
+    {
+        mtx.lockForWrite();
+
+        // Only a chunk of a longer lifetime has run out
+        const qint64 remaining = deadlines.value(key, 0) - now();
+        if (deadlines.contains(key) && remaining > 0) {
+            arm(timers.value(key), remaining);
+            mtx.unlock();
+            return;
+        }
+
+        if (holds(key)) {
+            record(Operation::Remove, key);
+            notifyRemoved(key);
+        }
+
+        // Parked values are only decoded if someone wants them, one that
+        // can't be read back is dropped all the same
+        if (expirationHandler) {
+            fault(key);
+        }
+        dropParked(key);
+
+        const auto & value = items.take(key);
+        removeTimer(key);
+        forget(key);
+
+        mtx.unlock();
+
+        if (expirationHandler) {
+            expirationHandler(key, value);
+        }
+    });
+
+    return timer;
+}
+
+template<class K, class V>
+void ExpiringStorage<K,V>::removeTimer(const K & key)
+{
+    deadlines.remove(key);
+
+    auto * timerObject = timers.take(key);
+    if (timerObject)
+    {
+        QMetaObject::invokeMethod(timerObject,
+                                  "deleteLater",
+                                  Qt::QueuedConnection);
+    }
+}
+
+template<class K, class V>
+void ExpiringStorage<K,V>::arm(QTimer * timer, qint64 remainingMsec)
+{
+    QMetaObject::invokeMethod(timer,
+                              "start",
+                              Qt::QueuedConnection,
+                              Q_ARG(int, int(qMin<qint64>(remainingMsec, INT_MAX))));
+}
+
 }
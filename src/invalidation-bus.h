@@ -0,0 +1,394 @@
+#pragma once
+
+#include <QByteArray>
+#include <QDataStream>
+#include <QHostAddress>
+#include <QList>
+#include <QMap>
+#include <QMutex>
+#include <QSet>
+#include <QString>
+#include <QStringList>
+#include <QTimer>
+#include <QUdpSocket>
+#include <random>
+
+#include "expiring-storage.h"
+
+
+namespace qtstorage {
+
+struct InvalidationBusOptions {
+    QHostAddress group = QHostAddress(QStringLiteral("239.255.43.21"));
+    quint16 port = 45454;
+    int coalesceMsec = 5;
+    int maxDatagramBytes = 1400;
+};
+
+// Drops invalidated keys from every attached storage right away and
+// publishes them, coalesced into datagrams, to the buses of other
+// processes on the same host via loopback multicast
+template <class K, class V>
+class InvalidationBus {
+public:
+    using Storage = ExpiringStorage<K, V>;
+    using Options = InvalidationBusOptions;
+
+public:
+    inline explicit InvalidationBus(const Options & options = Options());
+    inline ~InvalidationBus();
+
+    inline bool open();
+    inline void close();
+
+    inline void attach(Storage * storage);
+    inline void detach(Storage * storage);
+
+    // A key keeps its tags until it is invalidated or has left every
+    // attached storage
+    inline void tag(const K & key, const QString & tag);
+
+    inline void invalidate(const K & key);
+    inline void invalidateTag(const QString & tag);
+
+private:
+    static constexpr quint32 PacketMagic = 0x51544942;
+
+    enum RecordKind : quint8 {
+        Key = 1,
+        Tag = 2
+    };
+
+    inline void drop(const QList<K> & keys, const QStringList & tags);
+    inline void depart(const K & key);
+    inline void prune();
+    inline void untag(const K & key);
+    inline void schedule();
+    inline void flush();
+    inline void receive();
+
+    template<class T>
+    static inline QByteArray encode(RecordKind kind, const T & data);
+
+private:
+    const Options opts;
+    const quint64 origin;
+
+    QUdpSocket socket;
+    QTimer flushTimer;
+
+    QMutex mtx;
+    QList<Storage *> storages;
+    QMap<QString, QSet<K>> tagged;
+    QMap<K, QSet<QString>> tagsOf;
+
+    // Tagged keys some storage removed, they are untagged once no
+    // attached storage holds them
+    QSet<K> departed;
+    QMap<K, bool> pendingKeys;
+    QSet<QString> pendingTags;
+    bool flushPending = false;
+};
+
+template<class K, class V>
+InvalidationBus<K, V>::InvalidationBus(const Options & options) :
+    opts(options),
+    origin(std::random_device()() | (quint64(std::random_device()()) << 32))
+{
+    flushTimer.setSingleShot(true);
+    flushTimer.setInterval(opts.coalesceMsec);
+
+    QObject::connect(&flushTimer, &QTimer::timeout, &flushTimer, [this]() -> void { flush(); });
+    QObject::connect(&socket, &QUdpSocket::readyRead, &socket, [this]() -> void { receive(); });
+}
+
+template<class K, class V>
+InvalidationBus<K, V>::~InvalidationBus()
+{
+    for (auto * storage : storages) {
+        storage->installRemovalHandler(nullptr);
+    }
+}
+
+template<class K, class V>
+bool InvalidationBus<K, V>::open()
+{
+    if (!socket.bind(QHostAddress(QHostAddress::AnyIPv4),
+                     opts.port,
+                     QUdpSocket::ShareAddress | QUdpSocket::ReuseAddressHint)) {
+        return false;
+    }
+
+    // Datagrams stay on this host and come back to every process in the group
+    socket.setSocketOption(QAbstractSocket::MulticastTtlOption, 0);
+    socket.setSocketOption(QAbstractSocket::MulticastLoopbackOption, 1);
+    return socket.joinMulticastGroup(opts.group);
+}
+
+template<class K, class V>
+void InvalidationBus<K, V>::close()
+{
+    flush();
+    socket.close();
+}
+
+template<class K, class V>
+void InvalidationBus<K, V>::attach(Storage * storage)
+{
+    QMutexLocker locker(&mtx);
+    if (storages.contains(storage)) {
+        return;
+    }
+    storages.append(storage);
+    locker.unlock();
+
+    // The storage calls the handler under its own lock, so it is never
+    // installed or called with the bus lock held
+    storage->installRemovalHandler([this](const K & key) -> void { depart(key); });
+}
+
+template<class K, class V>
+void InvalidationBus<K, V>::detach(Storage * storage)
+{
+    QMutexLocker locker(&mtx);
+    if (!storages.removeOne(storage)) {
+        return;
+    }
+    locker.unlock();
+
+    storage->installRemovalHandler(nullptr);
+}
+
+template<class K, class V>
+void InvalidationBus<K, V>::tag(const K & key, const QString & tag)
+{
+    prune();
+
+    QMutexLocker locker(&mtx);
+    tagged[tag].insert(key);
+    tagsOf[key].insert(tag);
+    departed.remove(key);
+}
+
+template<class K, class V>
+void InvalidationBus<K, V>::invalidate(const K & key)
+{
+    drop(QList<K>() << key, QStringList());
+
+    QMutexLocker locker(&mtx);
+    pendingKeys.insert(key, true);
+    schedule();
+}
+
+template<class K, class V>
+void InvalidationBus<K, V>::invalidateTag(const QString & tag)
+{
+    drop(QList<K>(), QStringList() << tag);
+
+    QMutexLocker locker(&mtx);
+    pendingTags.insert(tag);
+    schedule();
+}
+
+template<class K, class V>
+void InvalidationBus<K, V>::drop(const QList<K> & keys, const QStringList & tags)
+{
+    prune();
+
+    QMutexLocker locker(&mtx);
+
+    QList<K> dropped = keys;
+    for (const auto & key : keys) {
+        untag(key);
+    }
+
+    for (const auto & tag : tags) {
+        for (const auto & key : tagged.take(tag)) {
+            dropped.append(key);
+
+            auto it = tagsOf.find(key);
+            if (it != tagsOf.end()) {
+                it.value().remove(tag);
+                if (it.value().isEmpty()) {
+                    tagsOf.erase(it);
+                }
+            }
+        }
+    }
+
+    const auto targets = storages;
+    locker.unlock();
+
+    for (auto * storage : targets) {
+        for (const auto & key : dropped) {
+            storage->remove(key);
+        }
+    }
+}
+
+template<class K, class V>
+void InvalidationBus<K, V>::depart(const K & key)
+{
+    QMutexLocker locker(&mtx);
+    if (tagsOf.contains(key)) {
+        departed.insert(key);
+    }
+}
+
+template<class K, class V>
+void InvalidationBus<K, V>::prune()
+{
+    QMutexLocker locker(&mtx);
+    if (departed.isEmpty()) {
+        return;
+    }
+
+    const QSet<K> candidates = departed;
+    const auto targets = storages;
+    locker.unlock();
+
+    // Asked without the bus lock, storages take it in their removal handler
+    QList<K> held;
+    QList<K> gone;
+    for (const auto & key : candidates) {
+        bool found = false;
+        for (auto * storage : targets) {
+            if (storage->contains(key)) {
+                found = true;
+                break;
+            }
+        }
+        (found ? held : gone).append(key);
+    }
+
+    // A key tagged again meanwhile has left the departed set and stays
+    locker.relock();
+    for (const auto & key : held) {
+        departed.remove(key);
+    }
+    for (const auto & key : gone) {
+        if (departed.remove(key)) {
+            untag(key);
+        }
+    }
+}
+
+template<class K, class V>
+void InvalidationBus<K, V>::untag(const K & key)
+{
+    for (const auto & tag : tagsOf.take(key)) {
+        auto it = tagged.find(tag);
+        if (it != tagged.end()) {
+            it.value().remove(key);
+            if (it.value().isEmpty()) {
+                tagged.erase(it);
+            }
+        }
+    }
+}
+
+template<class K, class V>
+void InvalidationBus<K, V>::schedule()
+{
+    if (!flushPending) {
+        flushPending = true;
+        QMetaObject::invokeMethod(&flushTimer, "start", Qt::QueuedConnection);
+    }
+}
+
+template<class K, class V>
+void InvalidationBus<K, V>::flush()
+{
+    QMutexLocker locker(&mtx);
+
+    QList<QByteArray> records;
+    for (auto it = pendingKeys.constBegin(); it != pendingKeys.constEnd(); ++it) {
+        records.append(encode(Key, it.key()));
+    }
+    for (const auto & tag : pendingTags) {
+        records.append(encode(Tag, tag));
+    }
+
+    pendingKeys.clear();
+    pendingTags.clear();
+    flushPending = false;
+    locker.unlock();
+
+    QByteArray header;
+    QDataStream stream(&header, QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_5_6);
+    stream << PacketMagic << origin;
+
+    // As many records as fit go into each datagram
+    QByteArray datagram = header;
+    for (const auto & record : records) {
+        if (datagram.size() > header.size()
+                && datagram.size() + record.size() > opts.maxDatagramBytes) {
+            socket.writeDatagram(datagram, opts.group, opts.port);
+            datagram = header;
+        }
+        datagram.append(record);
+    }
+
+    if (datagram.size() > header.size()) {
+        socket.writeDatagram(datagram, opts.group, opts.port);
+    }
+}
+
+template<class K, class V>
+void InvalidationBus<K, V>::receive()
+{
+    while (socket.hasPendingDatagrams()) {
+        QByteArray datagram(int(socket.pendingDatagramSize()), Qt::Uninitialized);
+        socket.readDatagram(datagram.data(), datagram.size());
+
+        QDataStream stream(datagram);
+        stream.setVersion(QDataStream::Qt_5_6);
+
+        quint32 magic = 0;
+        quint64 sender = 0;
+        stream >> magic >> sender;
+
+        // Our own datagrams come back through the loopback
+        if (magic != PacketMagic || sender == origin) {
+            continue;
+        }
+
+        QList<K> keys;
+        QStringList tags;
+        while (!stream.atEnd() && stream.status() == QDataStream::Ok) {
+            quint8 kind = 0;
+            stream >> kind;
+
+            if (kind == Key) {
+                K key;
+                stream >> key;
+                keys.append(key);
+            } else if (kind == Tag) {
+                QString tag;
+                stream >> tag;
+                tags.append(tag);
+            } else {
+                break;
+            }
+        }
+
+        if (stream.status() == QDataStream::Ok) {
+            drop(keys, tags);
+        }
+    }
+}
+
+template<class K, class V>
+template<class T>
+QByteArray InvalidationBus<K, V>::encode(RecordKind kind, const T & data)
+{
+    QByteArray encoded;
+    QDataStream stream(&encoded, QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_5_6);
+
+    stream << quint8(kind) << data;
+    return encoded;
+}
+
+}
@@ -0,0 +1,364 @@
+#pragma once
+
+#include <QByteArray>
+#include <QFile>
+#include <QMutex>
+#include <QString>
+#include <QWaitCondition>
+#include <QtGlobal>
+#include <deque>
+#include <functional>
+#include <future>
+#include <thread>
+
+#if defined(Q_OS_UNIX)
+#include <unistd.h>
+#endif
+
+
+namespace qtstorage {
+
+struct JournalOptions {
+    qint64 flushIntervalMsec = 5;
+    qint64 flushBytes = 256 * 1024;
+
+    // Compaction snapshots the storage and drops the journal up to it,
+    // once the journal reaches compactBytes and every compactIntervalMsec
+    // if it has grown since. 0 turns either trigger off
+    qint64 compactBytes = 64 * 1024 * 1024;
+    qint64 compactIntervalMsec = 10 * 60 * 1000;
+};
+
+class Journal {
+public:
+    using Options = JournalOptions;
+    using Visitor = std::function<void(const QByteArray &)>;
+
+public:
+    inline explicit Journal(const QString & path, const Options & options = Options());
+    inline ~Journal();
+
+    inline bool open();
+    inline void close();
+
+    inline qint64 append(const QByteArray & record);
+    inline bool sync();
+    inline qint64 size();
+
+    inline std::future<bool> rotate();
+    inline bool tryBeginCompaction();
+    inline void endCompaction(bool succeeded);
+
+    inline const Options & options() const;
+
+    static inline QString previousPath(const QString & path);
+    static inline bool replay(const QString & path, const Visitor & visitor);
+
+private:
+    struct Rotation {
+        qint64 offset;
+        std::promise<bool> done;
+    };
+
+    inline void run();
+    inline bool write(const char * data, qint64 size);
+    inline bool rotateFile();
+
+    static inline bool syncFile(QFile & target);
+
+private:
+    const QString path;
+    const Options opts;
+
+    QFile file;
+    std::thread writer;
+
+    QMutex mtx;
+    QWaitCondition wakeWriter;
+    QWaitCondition wakeSyncers;
+
+    QByteArray pending;
+    qint64 appended = 0;
+    qint64 durable = 0;
+    qint64 fileSize = 0;
+    int syncWaiters = 0;
+    bool stopping = false;
+    bool failed = false;
+    bool compacting = false;
+    std::deque<Rotation> rotations;
+};
+
+Journal::Journal(const QString & path, const Options & options) :
+    path(path),
+    opts(options)
+{}
+
+Journal::~Journal()
+{
+    close();
+}
+
+bool Journal::open()
+{
+    file.setFileName(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Append)) {
+        return false;
+    }
+
+    fileSize = file.size();
+    stopping = false;
+    writer = std::thread([this]() -> void { run(); });
+    return true;
+}
+
+void Journal::close()
+{
+    if (!writer.joinable()) {
+        return;
+    }
+
+    mtx.lock();
+    stopping = true;
+    wakeWriter.wakeOne();
+    mtx.unlock();
+
+    writer.join();
+    file.close();
+}
+
+qint64 Journal::append(const QByteArray & record)
+{
+    QMutexLocker locker(&mtx);
+    const bool wasEmpty = pending.isEmpty();
+
+    const quint32 length = quint32(record.size());
+    pending.append(char(length >> 24));
+    pending.append(char(length >> 16));
+    pending.append(char(length >> 8));
+    pending.append(char(length));
+    pending.append(record);
+
+    const qint64 framed = qint64(sizeof(length)) + record.size();
+    appended += framed;
+    fileSize += framed;
+
+    if (wasEmpty || pending.size() >= opts.flushBytes) {
+        wakeWriter.wakeOne();
+    }
+
+    return fileSize;
+}
+
+bool Journal::sync()
+{
+    QMutexLocker locker(&mtx);
+
+    const qint64 target = appended;
+    ++syncWaiters;
+    wakeWriter.wakeOne();
+
+    while (durable < target && !failed && writer.joinable()) {
+        wakeSyncers.wait(&mtx);
+    }
+
+    --syncWaiters;
+    return (durable >= target);
+}
+
+qint64 Journal::size()
+{
+    QMutexLocker locker(&mtx);
+    return fileSize;
+}
+
+std::future<bool> Journal::rotate()
+{
+    QMutexLocker locker(&mtx);
+
+    rotations.push_back(Rotation{appended, std::promise<bool>()});
+    auto result = rotations.back().done.get_future();
+
+    fileSize = 0;
+    wakeWriter.wakeOne();
+    return result;
+}
+
+bool Journal::tryBeginCompaction()
+{
+    QMutexLocker locker(&mtx);
+    if (compacting) {
+        return false;
+    }
+
+    compacting = true;
+    return true;
+}
+
+void Journal::endCompaction(bool succeeded)
+{
+    if (succeeded) {
+        QFile::remove(previousPath(path));
+    }
+
+    QMutexLocker locker(&mtx);
+    compacting = false;
+}
+
+const Journal::Options & Journal::options() const
+{
+    return opts;
+}
+
+QString Journal::previousPath(const QString & path)
+{
+    return path + QStringLiteral(".prev");
+}
+
+bool Journal::replay(const QString & path, const Visitor & visitor)
+{
+    QFile input(path);
+    if (!input.exists()) {
+        return true;
+    }
+
+    if (!input.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+
+    // A torn record at the tail is what a crash mid-write leaves behind,
+    // replay stops there
+    const QByteArray data = input.readAll();
+    const auto * bytes = reinterpret_cast<const uchar *>(data.constData());
+    int offset = 0;
+
+    while (data.size() - offset >= 4) {
+        const quint32 length = (quint32(bytes[offset]) << 24)
+                             | (quint32(bytes[offset + 1]) << 16)
+                             | (quint32(bytes[offset + 2]) << 8)
+                             | quint32(bytes[offset + 3]);
+        offset += 4;
+
+        if (quint32(data.size() - offset) < length) {
+            break;
+        }
+
+        visitor(QByteArray::fromRawData(data.constData() + offset, int(length)));
+        offset += int(length);
+    }
+
+    return true;
+}
+
+void Journal::run()
+{
+    QMutexLocker locker(&mtx);
+
+    while (true) {
+        if (!stopping && rotations.empty()) {
+            if (pending.isEmpty()) {
+                wakeWriter.wait(&mtx);
+                continue;
+            }
+
+            // Group commit: records appended within one interval share a sync
+            if (syncWaiters == 0 && pending.size() < opts.flushBytes) {
+                wakeWriter.wait(&mtx, (unsigned long)(opts.flushIntervalMsec));
+            }
+        }
+
+        if (pending.isEmpty() && rotations.empty()) {
+            if (stopping) {
+                break;
+            }
+            continue;
+        }
+
+        QByteArray batch;
+        batch.swap(pending);
+        std::deque<Rotation> batchRotations;
+        batchRotations.swap(rotations);
+
+        const qint64 batchEnd = appended;
+        const qint64 batchStart = batchEnd - batch.size();
+
+        locker.unlock();
+
+        bool ok = true;
+        qint64 written = batchStart;
+        for (auto & rotation : batchRotations) {
+            ok = write(batch.constData() + (written - batchStart), rotation.offset - written)
+                    && syncFile(file) && ok;
+            written = rotation.offset;
+
+            const bool rotated = ok && rotateFile();
+            rotation.done.set_value(rotated);
+            ok = rotated;
+        }
+
+        ok = write(batch.constData() + (written - batchStart), batchEnd - written)
+                && syncFile(file) && ok;
+
+        locker.relock();
+
+        if (ok) {
+            durable = batchEnd;
+        } else {
+            failed = true;
+        }
+        wakeSyncers.wakeAll();
+    }
+}
+
+bool Journal::write(const char * data, qint64 size)
+{
+    return (size == 0 || file.write(data, size) == size);
+}
+
+bool Journal::rotateFile()
+{
+    const QString previous = previousPath(path);
+    file.close();
+
+    // An unfinished compaction still owns the previous file, so keep
+    // accumulating into it instead of replacing it
+    if (QFile::exists(previous)) {
+        QFile source(path);
+        QFile target(previous);
+        if (!source.open(QIODevice::ReadOnly)
+                || !target.open(QIODevice::WriteOnly | QIODevice::Append)) {
+            return false;
+        }
+
+        const QByteArray content = source.readAll();
+        if (target.write(content) != content.size() || !syncFile(target)) {
+            return false;
+        }
+
+        source.close();
+        target.close();
+        if (!QFile::remove(path)) {
+            return false;
+        }
+    } else if (!QFile::rename(path, previous)) {
+        return false;
+    }
+
+    return file.open(QIODevice::WriteOnly | QIODevice::Append);
+}
+
+bool Journal::syncFile(QFile & target)
+{
+    if (!target.flush()) {
+        return false;
+    }
+
+#if defined(Q_OS_LINUX)
+    return (::fdatasync(target.handle()) == 0);
+#elif defined(Q_OS_UNIX)
+    return (::fsync(target.handle()) == 0);
+#else
+    return true;
+#endif
+}
+
+}
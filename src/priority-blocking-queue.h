@@ -0,0 +1,259 @@
+#pragma once
+
+#include <QMutex>
+#include <QWaitCondition>
+#include <functional>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "detail/wait.h"
+
+
+namespace qtstorage {
+
+// BlockingQueue that hands out the greatest item according to Compare
+// first, items comparing equal come out in insertion order
+template <class T, class Compare = std::less<T>>
+class PriorityBlockingQueue {
+public:
+    inline explicit PriorityBlockingQueue(int capacity = 0, const Compare & comparator = Compare());
+
+    inline bool enqueue(const T & item, qint64 timeout = -1);
+    inline bool enqueue(T && item, qint64 timeout = -1);
+    template<class... Args>
+    inline bool emplace(Args &&... args);
+    inline bool tryEnqueue(const T & item);
+    inline bool tryEnqueue(T && item);
+    inline T dequeue(qint64 timeout = -1, bool * ok = nullptr);
+    inline std::optional<T> dequeueFor(qint64 timeout);
+    inline std::optional<T> tryDequeue();
+    inline int size() const;
+    inline int capacity() const;
+
+    inline void close();
+    inline bool isClosed() const;
+
+private:
+    // Four children per node keep a sift-down within one or two cache
+    // lines and halve the depth of a binary heap
+    static constexpr size_t Arity = 4;
+
+    struct Entry {
+        T item;
+        quint64 order;
+    };
+
+    template<class... Args>
+    inline bool put(qint64 timeout, Args &&... args);
+    inline T takeTop();
+
+    inline bool before(const Entry & left, const Entry & right) const;
+    inline void siftUp(size_t index);
+    inline void siftDown(size_t index);
+
+
+private:
+    std::vector<Entry> heap;
+    Compare compare;
+    quint64 nextOrder = 0;
+
+    mutable QMutex mtx;
+    QWaitCondition notEmpty;
+    QWaitCondition notFull;
+    int waitingConsumers = 0;
+    int waitingProducers = 0;
+    bool closed = false;
+
+    const int limit;
+};
+
+template<class T, class Compare>
+PriorityBlockingQueue<T, Compare>::PriorityBlockingQueue(int capacity, const Compare & comparator) :
+    compare(comparator),
+    limit(qMax(capacity, 0))
+{}
+
+template<class T, class Compare>
+bool PriorityBlockingQueue<T, Compare>::enqueue(const T & item, qint64 timeout)
+{
+    return put(timeout, item);
+}
+
+template<class T, class Compare>
+bool PriorityBlockingQueue<T, Compare>::enqueue(T && item, qint64 timeout)
+{
+    return put(timeout, std::move(item));
+}
+
+template<class T, class Compare>
+template<class... Args>
+bool PriorityBlockingQueue<T, Compare>::emplace(Args &&... args)
+{
+    return put(-1, std::forward<Args>(args)...);
+}
+
+template<class T, class Compare>
+bool PriorityBlockingQueue<T, Compare>::tryEnqueue(const T & item)
+{
+    return put(0, item);
+}
+
+template<class T, class Compare>
+bool PriorityBlockingQueue<T, Compare>::tryEnqueue(T && item)
+{
+    return put(0, std::move(item));
+}
+
+template<class T, class Compare>
+T PriorityBlockingQueue<T, Compare>::dequeue(qint64 timeout, bool * ok)
+{
+    return detail::unwrap(dequeueFor(timeout), ok);
+}
+
+template<class T, class Compare>
+std::optional<T> PriorityBlockingQueue<T, Compare>::dequeueFor(qint64 timeout)
+{
+    QMutexLocker locker(&mtx);
+    if (!detail::waitUntil(mtx, notEmpty, waitingConsumers, timeout, [this]() -> bool { return closed || !heap.empty(); })
+            || heap.empty()) {
+        return std::nullopt;
+    }
+
+    std::optional<T> item(takeTop());
+    if (waitingProducers > 0) {
+        notFull.wakeOne();
+    }
+    return item;
+}
+
+template<class T, class Compare>
+std::optional<T> PriorityBlockingQueue<T, Compare>::tryDequeue()
+{
+    return dequeueFor(0);
+}
+
+template<class T, class Compare>
+int PriorityBlockingQueue<T, Compare>::size() const
+{
+    QMutexLocker locker(&mtx);
+    return int(heap.size());
+}
+
+template<class T, class Compare>
+int PriorityBlockingQueue<T, Compare>::capacity() const
+{
+    return limit;
+}
+
+template<class T, class Compare>
+void PriorityBlockingQueue<T, Compare>::close()
+{
+    QMutexLocker locker(&mtx);
+    closed = true;
+
+    notEmpty.wakeAll();
+    notFull.wakeAll();
+}
+
+template<class T, class Compare>
+bool PriorityBlockingQueue<T, Compare>::isClosed() const
+{
+    QMutexLocker locker(&mtx);
+    return closed;
+}
+
+template<class T, class Compare>
+template<class... Args>
+bool PriorityBlockingQueue<T, Compare>::put(qint64 timeout, Args &&... args)
+{
+    QMutexLocker locker(&mtx);
+    const auto ready = [this]() -> bool { return closed || limit == 0 || int(heap.size()) < limit; };
+    if (!detail::waitUntil(mtx, notFull, waitingProducers, timeout, ready) || closed) {
+        return false;
+    }
+
+    heap.push_back(Entry{T(std::forward<Args>(args)...), nextOrder++});
+    siftUp(heap.size() - 1);
+
+    if (waitingConsumers > 0) {
+        notEmpty.wakeOne();
+    }
+    return true;
+}
+
+template<class T, class Compare>
+T PriorityBlockingQueue<T, Compare>::takeTop()
+{
+    T item = std::move(heap.front().item);
+
+    if (heap.size() > 1) {
+        heap.front() = std::move(heap.back());
+    }
+    heap.pop_back();
+
+    if (!heap.empty()) {
+        siftDown(0);
+    }
+    return item;
+}
+
+template<class T, class Compare>
+bool PriorityBlockingQueue<T, Compare>::before(const Entry & left, const Entry & right) const
+{
+    if (compare(right.item, left.item)) {
+        return true;
+    }
+    return (!compare(left.item, right.item) && left.order < right.order);
+}
+
+template<class T, class Compare>
+void PriorityBlockingQueue<T, Compare>::siftUp(size_t index)
+{
+    Entry entry = std::move(heap[index]);
+
+    while (index > 0) {
+        const size_t parent = (index - 1) / Arity;
+        if (!before(entry, heap[parent])) {
+            break;
+        }
+
+        heap[index] = std::move(heap[parent]);
+        index = parent;
+    }
+
+    heap[index] = std::move(entry);
+}
+
+template<class T, class Compare>
+void PriorityBlockingQueue<T, Compare>::siftDown(size_t index)
+{
+    const size_t count = heap.size();
+    Entry entry = std::move(heap[index]);
+
+    while (true) {
+        const size_t first = index * Arity + 1;
+        if (first >= count) {
+            break;
+        }
+
+        size_t best = first;
+        const size_t last = qMin(first + Arity, count);
+        for (size_t child = first + 1; child < last; ++child) {
+            if (before(heap[child], heap[best])) {
+                best = child;
+            }
+        }
+
+        if (!before(heap[best], entry)) {
+            break;
+        }
+
+        heap[index] = std::move(heap[best]);
+        index = best;
+    }
+
+    heap[index] = std::move(entry);
+}
+
+}
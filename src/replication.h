@@ -0,0 +1,555 @@
+#pragma once
+
+#include <QBuffer>
+#include <QByteArray>
+#include <QDataStream>
+#include <QDateTime>
+#include <QList>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QMutex>
+#include <QSharedPointer>
+#include <QTimer>
+#include <deque>
+
+#include "expiring-storage.h"
+
+
+namespace qtstorage {
+
+struct ReplicationOptions {
+    int batchIntervalMsec = 2;
+    int maxBatchBytes = 64 * 1024;
+    qint64 maxPendingBytes = 1024 * 1024;
+    qint64 maxBacklogBytes = 16 * 1024 * 1024;
+};
+
+// Length-prefixed frames exchanged between a primary and its replicas
+class ReplicationFrame {
+public:
+    enum Type : quint8 {
+        Hello = 1,
+        Batch = 2,
+        Snapshot = 3
+    };
+
+public:
+    static inline QByteArray encode(const QByteArray & payload);
+    static inline bool next(const QByteArray & buffer, int & offset, QByteArray * payload);
+};
+
+// Streams the mutations of an ExpiringStorage to replicas connected over
+// a local socket: mutations are batched per replica, a replica whose socket
+// is not draining gets nothing more until it does, and one that falls out
+// of the backlog is resynced with a snapshot
+template <class K, class V>
+class ReplicationPrimary {
+public:
+    using Storage = ExpiringStorage<K, V>;
+    using Options = ReplicationOptions;
+
+public:
+    inline explicit ReplicationPrimary(Storage * storage, const Options & options = Options());
+    inline ~ReplicationPrimary();
+
+    inline bool listen(const QString & name);
+    inline void close();
+    inline int replicaCount() const;
+
+private:
+    struct Peer {
+        QLocalSocket * socket = nullptr;
+        QByteArray buffer;
+        quint64 sent = 0;
+        bool ready = false;
+        bool resync = false;
+    };
+
+    inline void append(quint64 sequence, const QByteArray & mutation);
+    inline void accept(QLocalSocket * socket);
+    inline void receive(const QSharedPointer<Peer> & peer);
+
+    inline void flush();
+    inline bool send(const QSharedPointer<Peer> & peer);
+    inline void resync(const QSharedPointer<Peer> & peer);
+    inline void trim();
+    inline bool covers(quint64 sequence) const;
+
+private:
+    Storage * storage;
+    const Options opts;
+    const quint64 epoch;
+
+    QLocalServer server;
+    QTimer flushTimer;
+    QList<QSharedPointer<Peer>> peers;
+
+    QMutex mtx;
+    std::deque<QByteArray> backlog;
+    quint64 backlogFirst = 1;
+    quint64 lastSequence = 0;
+    qint64 backlogBytes = 0;
+    bool flushPending = false;
+};
+
+// Applies the mutation stream of a ReplicationPrimary to a local storage,
+// which serves reads as usual
+template <class K, class V>
+class Replica {
+public:
+    using Storage = ExpiringStorage<K, V>;
+
+public:
+    inline explicit Replica(Storage * storage);
+
+    inline void connectToPrimary(const QString & name);
+    inline void disconnectFromPrimary();
+
+    inline bool isConnected() const;
+    inline quint64 appliedSequence() const;
+
+private:
+    static constexpr int ReconnectIntervalMsec = 1000;
+
+    inline void hello();
+    inline void receive();
+    inline void applyBatch(quint64 frameEpoch, QDataStream & stream);
+    inline bool applySnapshot(quint64 frameEpoch, QDataStream & stream);
+
+private:
+    Storage * storage;
+    QLocalSocket socket;
+    QTimer reconnectTimer;
+    QString primaryName;
+
+    QByteArray buffer;
+    quint64 epoch = 0;
+    quint64 applied = 0;
+    bool resyncing = false;
+};
+
+QByteArray ReplicationFrame::encode(const QByteArray & payload)
+{
+    const quint32 length = quint32(payload.size());
+
+    QByteArray framed;
+    framed.reserve(int(sizeof(length)) + payload.size());
+    framed.append(char(length >> 24));
+    framed.append(char(length >> 16));
+    framed.append(char(length >> 8));
+    framed.append(char(length));
+    framed.append(payload);
+    return framed;
+}
+
+bool ReplicationFrame::next(const QByteArray & buffer, int & offset, QByteArray * payload)
+{
+    if (buffer.size() - offset < 4) {
+        return false;
+    }
+
+    const auto * bytes = reinterpret_cast<const uchar *>(buffer.constData() + offset);
+    const quint32 length = (quint32(bytes[0]) << 24)
+                         | (quint32(bytes[1]) << 16)
+                         | (quint32(bytes[2]) << 8)
+                         | quint32(bytes[3]);
+
+    if (quint32(buffer.size() - offset - 4) < length) {
+        return false;
+    }
+
+    *payload = buffer.mid(offset + 4, int(length));
+    offset += 4 + int(length);
+    return true;
+}
+
+template<class K, class V>
+ReplicationPrimary<K, V>::ReplicationPrimary(Storage * storage, const Options & options) :
+    storage(storage),
+    opts(options),
+    epoch(quint64(QDateTime::currentMSecsSinceEpoch()))
+{
+    flushTimer.setSingleShot(true);
+    flushTimer.setInterval(opts.batchIntervalMsec);
+
+    QObject::connect(&flushTimer, &QTimer::timeout, &flushTimer, [this]() -> void { flush(); });
+    QObject::connect(&server, &QLocalServer::newConnection, &server, [this]() -> void
+    {
+        while (auto * socket = server.nextPendingConnection()) {
+            accept(socket);
+        }
+    });
+
+    storage->installMutationHandler([this](quint64 sequence, const QByteArray & mutation) -> void
+    {
+        append(sequence, mutation);
+    });
+}
+
+template<class K, class V>
+ReplicationPrimary<K, V>::~ReplicationPrimary()
+{
+    storage->installMutationHandler(nullptr);
+    close();
+}
+
+template<class K, class V>
+bool ReplicationPrimary<K, V>::listen(const QString & name)
+{
+    QLocalServer::removeServer(name);
+    return server.listen(name);
+}
+
+template<class K, class V>
+void ReplicationPrimary<K, V>::close()
+{
+    server.close();
+
+    const auto current = peers;
+    for (const auto & peer : current) {
+        peer->socket->abort();
+    }
+    peers.clear();
+}
+
+template<class K, class V>
+int ReplicationPrimary<K, V>::replicaCount() const
+{
+    return peers.size();
+}
+
+template<class K, class V>
+void ReplicationPrimary<K, V>::append(quint64 sequence, const QByteArray & mutation)
+{
+    // Called under the storage write lock, from whichever thread mutated it
+    QMutexLocker locker(&mtx);
+
+    if (backlog.empty()) {
+        backlogFirst = sequence;
+    }
+    backlog.push_back(mutation);
+    backlogBytes += mutation.size();
+    lastSequence = sequence;
+
+    while (backlogBytes > opts.maxBacklogBytes && backlog.size() > 1) {
+        backlogBytes -= backlog.front().size();
+        backlog.pop_front();
+        ++backlogFirst;
+    }
+
+    if (!flushPending) {
+        flushPending = true;
+        QMetaObject::invokeMethod(&flushTimer, "start", Qt::QueuedConnection);
+    }
+}
+
+template<class K, class V>
+void ReplicationPrimary<K, V>::accept(QLocalSocket * socket)
+{
+    auto peer = QSharedPointer<Peer>::create();
+    peer->socket = socket;
+    peers.append(peer);
+
+    QObject::connect(socket, &QLocalSocket::readyRead, socket, [this, peer]() -> void
+    {
+        receive(peer);
+    });
+    QObject::connect(socket, &QLocalSocket::disconnected, socket, [this, peer]() -> void
+    {
+        peers.removeOne(peer);
+        peer->socket->deleteLater();
+    });
+}
+
+template<class K, class V>
+void ReplicationPrimary<K, V>::receive(const QSharedPointer<Peer> & peer)
+{
+    peer->buffer.append(peer->socket->readAll());
+
+    int offset = 0;
+    QByteArray payload;
+    while (ReplicationFrame::next(peer->buffer, offset, &payload)) {
+        QDataStream stream(payload);
+        stream.setVersion(QDataStream::Qt_5_6);
+
+        quint8 type = 0;
+        quint64 replicaEpoch = 0;
+        quint64 applied = 0;
+        stream >> type >> replicaEpoch >> applied;
+
+        if (type != ReplicationFrame::Hello || stream.status() != QDataStream::Ok) {
+            continue;
+        }
+
+        // A replica that was following this primary resumes where it
+        // stopped if the backlog still reaches back that far
+        QMutexLocker locker(&mtx);
+        peer->ready = true;
+        peer->sent = applied;
+        peer->resync = (replicaEpoch != epoch || !covers(applied));
+    }
+    peer->buffer.remove(0, offset);
+
+    flushTimer.start();
+}
+
+template<class K, class V>
+void ReplicationPrimary<K, V>::flush()
+{
+    mtx.lock();
+    flushPending = false;
+    mtx.unlock();
+
+    bool behind = false;
+    for (const auto & peer : peers) {
+        if (peer->ready) {
+            behind = send(peer) || behind;
+        }
+    }
+
+    trim();
+
+    if (behind) {
+        flushTimer.start();
+    }
+}
+
+template<class K, class V>
+bool ReplicationPrimary<K, V>::send(const QSharedPointer<Peer> & peer)
+{
+    // Backpressure: nothing more is queued while the replica is not
+    // reading, it either catches up later or gets resynced
+    if (peer->socket->bytesToWrite() > opts.maxPendingBytes) {
+        return true;
+    }
+
+    QMutexLocker locker(&mtx);
+    if (peer->resync || !covers(peer->sent)) {
+        locker.unlock();
+        resync(peer);
+        return true;
+    }
+
+    const quint64 first = peer->sent + 1;
+    QList<QByteArray> records;
+    int bytes = 0;
+
+    for (quint64 sequence = first; sequence <= lastSequence && bytes < opts.maxBatchBytes; ++sequence) {
+        const QByteArray & mutation = backlog[size_t(sequence - backlogFirst)];
+        records.append(mutation);
+        bytes += mutation.size();
+    }
+
+    const bool more = (first + quint64(records.size()) <= lastSequence);
+    locker.unlock();
+
+    if (records.isEmpty()) {
+        return false;
+    }
+
+    QByteArray payload;
+    QDataStream stream(&payload, QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_5_6);
+    stream << quint8(ReplicationFrame::Batch) << epoch << first << records;
+
+    peer->socket->write(ReplicationFrame::encode(payload));
+    peer->sent += quint64(records.size());
+    return more;
+}
+
+template<class K, class V>
+void ReplicationPrimary<K, V>::resync(const QSharedPointer<Peer> & peer)
+{
+    QBuffer snapshot;
+    snapshot.open(QIODevice::WriteOnly);
+
+    quint64 sequence = 0;
+    if (!storage->save(&snapshot, &sequence)) {
+        peer->socket->abort();
+        return;
+    }
+
+    QByteArray payload;
+    QDataStream stream(&payload, QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_5_6);
+    stream << quint8(ReplicationFrame::Snapshot) << epoch << sequence << snapshot.data();
+
+    peer->socket->write(ReplicationFrame::encode(payload));
+    peer->sent = sequence;
+    peer->resync = false;
+}
+
+template<class K, class V>
+void ReplicationPrimary<K, V>::trim()
+{
+    bool any = false;
+    quint64 oldest = 0;
+    for (const auto & peer : peers) {
+        if (peer->ready && !peer->resync && (!any || peer->sent < oldest)) {
+            oldest = peer->sent;
+            any = true;
+        }
+    }
+
+    // Mutations every replica already has are not needed anymore,
+    // a replica connecting later starts from a snapshot
+    QMutexLocker locker(&mtx);
+    while (!backlog.empty() && (!any || backlogFirst <= oldest)) {
+        backlogBytes -= backlog.front().size();
+        backlog.pop_front();
+        ++backlogFirst;
+    }
+}
+
+template<class K, class V>
+bool ReplicationPrimary<K, V>::covers(quint64 sequence) const
+{
+    return (sequence == lastSequence
+            || (!backlog.empty() && sequence + 1 >= backlogFirst && sequence <= lastSequence));
+}
+
+template<class K, class V>
+Replica<K, V>::Replica(Storage * storage) :
+    storage(storage)
+{
+    reconnectTimer.setInterval(ReconnectIntervalMsec);
+
+    QObject::connect(&socket, &QLocalSocket::connected, &socket, [this]() -> void { hello(); });
+    QObject::connect(&socket, &QLocalSocket::readyRead, &socket, [this]() -> void { receive(); });
+    QObject::connect(&socket, &QLocalSocket::disconnected, &socket, [this]() -> void { buffer.clear(); });
+
+    QObject::connect(&reconnectTimer, &QTimer::timeout, &reconnectTimer, [this]() -> void
+    {
+        if (socket.state() == QLocalSocket::UnconnectedState && !primaryName.isEmpty()) {
+            socket.connectToServer(primaryName);
+        }
+    });
+}
+
+template<class K, class V>
+void Replica<K, V>::connectToPrimary(const QString & name)
+{
+    primaryName = name;
+    socket.connectToServer(name);
+    reconnectTimer.start();
+}
+
+template<class K, class V>
+void Replica<K, V>::disconnectFromPrimary()
+{
+    primaryName.clear();
+    reconnectTimer.stop();
+    socket.disconnectFromServer();
+}
+
+template<class K, class V>
+bool Replica<K, V>::isConnected() const
+{
+    return (socket.state() == QLocalSocket::ConnectedState);
+}
+
+template<class K, class V>
+quint64 Replica<K, V>::appliedSequence() const
+{
+    return applied;
+}
+
+template<class K, class V>
+void Replica<K, V>::hello()
+{
+    QByteArray payload;
+    QDataStream stream(&payload, QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_5_6);
+    stream << quint8(ReplicationFrame::Hello) << epoch << applied;
+
+    socket.write(ReplicationFrame::encode(payload));
+}
+
+template<class K, class V>
+void Replica<K, V>::receive()
+{
+    buffer.append(socket.readAll());
+
+    int offset = 0;
+    QByteArray payload;
+    while (ReplicationFrame::next(buffer, offset, &payload)) {
+        QDataStream stream(payload);
+        stream.setVersion(QDataStream::Qt_5_6);
+
+        quint8 type = 0;
+        quint64 frameEpoch = 0;
+        stream >> type >> frameEpoch;
+
+        if (type == ReplicationFrame::Batch) {
+            applyBatch(frameEpoch, stream);
+        } else if (type == ReplicationFrame::Snapshot && !applySnapshot(frameEpoch, stream)) {
+            // Dropping the connection makes the reconnect timer start the
+            // resync over with a new Hello
+            buffer.clear();
+            socket.abort();
+            return;
+        }
+    }
+    buffer.remove(0, offset);
+}
+
+template<class K, class V>
+void Replica<K, V>::applyBatch(quint64 frameEpoch, QDataStream & stream)
+{
+    quint64 first = 0;
+    QList<QByteArray> records;
+    stream >> first >> records;
+
+    if (stream.status() != QDataStream::Ok) {
+        return;
+    }
+
+    // A gap means this replica missed mutations, the primary decides
+    // whether to resend them or to resync
+    if (frameEpoch != epoch || first > applied + 1) {
+        if (!resyncing) {
+            resyncing = true;
+            hello();
+        }
+        return;
+    }
+
+    resyncing = false;
+    for (int i = 0; i < records.size(); ++i) {
+        const quint64 sequence = first + quint64(i);
+        if (sequence <= applied) {
+            continue;
+        }
+
+        storage->apply(records.at(i));
+        applied = sequence;
+    }
+}
+
+template<class K, class V>
+bool Replica<K, V>::applySnapshot(quint64 frameEpoch, QDataStream & stream)
+{
+    quint64 sequence = 0;
+    QByteArray data;
+    stream >> sequence >> data;
+
+    if (stream.status() != QDataStream::Ok) {
+        return false;
+    }
+
+    QBuffer snapshot;
+    snapshot.setData(data);
+    snapshot.open(QIODevice::ReadOnly);
+
+    // Decoded aside and swapped in, reads see the old content until then
+    if (!storage->reload(&snapshot)) {
+        return false;
+    }
+
+    epoch = frameEpoch;
+    applied = sequence;
+    resyncing = false;
+    return true;
+}
+
+}
@@ -0,0 +1,171 @@
+#pragma once
+
+#include <QMutex>
+#include <QWaitCondition>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+#include "detail/wait.h"
+
+
+namespace qtstorage {
+
+// Bounded lock-free MPMC ring buffer with the BlockingQueue interface:
+// producers and consumers only meet on a mutex when the ring is full
+// or empty and somebody has to sleep
+template <class T>
+class RingBlockingQueue {
+public:
+    inline explicit RingBlockingQueue(int capacity = 1024);
+
+    inline bool enqueue(const T & item, qint64 timeout = -1);
+    inline bool tryEnqueue(const T & item);
+    inline T dequeue(qint64 timeout = -1, bool * ok = nullptr);
+    inline int size() const;
+    inline int capacity() const;
+
+private:
+    static constexpr size_t CacheLine = 64;
+
+    // A cell is writable when its sequence equals the enqueue position
+    // and readable when it equals the dequeue position plus one
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T data;
+    };
+
+    inline bool push(const T & item);
+    inline bool pop(T * item);
+
+private:
+    const size_t mask;
+    std::unique_ptr<Cell[]> cells;
+
+    alignas(CacheLine) std::atomic<size_t> enqueuePos{0};
+    alignas(CacheLine) std::atomic<size_t> dequeuePos{0};
+
+    alignas(CacheLine) std::atomic<int> waitingProducers{0};
+    std::atomic<int> waitingConsumers{0};
+    QMutex mtx;
+    QWaitCondition notFull;
+    QWaitCondition notEmpty;
+};
+
+template<class T>
+RingBlockingQueue<T>::RingBlockingQueue(int capacity) :
+    mask(detail::roundUp(capacity) - 1),
+    cells(new Cell[mask + 1])
+{
+    for (size_t i = 0; i <= mask; ++i) {
+        cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+template<class T>
+bool RingBlockingQueue<T>::enqueue(const T & item, qint64 timeout)
+{
+    if (!push(item)) {
+        if (timeout == 0 || !detail::block(mtx, notFull, waitingProducers, timeout,
+                                           [&]() -> bool { return push(item); })) {
+            return false;
+        }
+    }
+
+    detail::wake(mtx, notEmpty, waitingConsumers);
+    return true;
+}
+
+template<class T>
+bool RingBlockingQueue<T>::tryEnqueue(const T & item)
+{
+    return enqueue(item, 0);
+}
+
+template<class T>
+T RingBlockingQueue<T>::dequeue(qint64 timeout, bool * ok)
+{
+    T item;
+    if (!pop(&item)) {
+        if (timeout == 0 || !detail::block(mtx, notEmpty, waitingConsumers, timeout,
+                                           [&]() -> bool { return pop(&item); })) {
+            if (ok) { *ok = false; }
+            return T();
+        }
+    }
+
+    detail::wake(mtx, notFull, waitingProducers);
+    if (ok) { *ok = true; }
+    return item;
+}
+
+template<class T>
+int RingBlockingQueue<T>::size() const
+{
+    const size_t head = dequeuePos.load(std::memory_order_acquire);
+    const size_t tail = enqueuePos.load(std::memory_order_acquire);
+    return (tail > head) ? int(qMin<size_t>(tail - head, mask + 1)) : 0;
+}
+
+template<class T>
+int RingBlockingQueue<T>::capacity() const
+{
+    return int(mask + 1);
+}
+
+template<class T>
+bool RingBlockingQueue<T>::push(const T & item)
+{
+    Cell * cell = nullptr;
+    size_t position = enqueuePos.load(std::memory_order_relaxed);
+
+    while (true) {
+        cell = &cells[position & mask];
+        const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+        const auto difference = std::ptrdiff_t(sequence) - std::ptrdiff_t(position);
+
+        if (difference == 0) {
+            if (enqueuePos.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (difference < 0) {
+            return false;
+        } else {
+            position = enqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+
+    cell->data = item;
+    cell->sequence.store(position + 1, std::memory_order_release);
+    return true;
+}
+
+template<class T>
+bool RingBlockingQueue<T>::pop(T * item)
+{
+    Cell * cell = nullptr;
+    size_t position = dequeuePos.load(std::memory_order_relaxed);
+
+    while (true) {
+        cell = &cells[position & mask];
+        const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+        const auto difference = std::ptrdiff_t(sequence) - std::ptrdiff_t(position + 1);
+
+        if (difference == 0) {
+            if (dequeuePos.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (difference < 0) {
+            return false;
+        } else {
+            position = dequeuePos.load(std::memory_order_relaxed);
+        }
+    }
+
+    *item = std::move(cell->data);
+    cell->data = T();
+    cell->sequence.store(position + mask + 1, std::memory_order_release);
+    return true;
+}
+
+}
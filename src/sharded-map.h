@@ -0,0 +1,238 @@
+#pragma once
+
+#include <QHash>
+#include <QList>
+#include <QMap>
+#include <array>
+
+
+namespace qtstorage {
+
+// QMap split into shards by key hash. A copy shares every shard, and a
+// write detaches only the shard it touches, so a writer racing a snapshot
+// copies one shard instead of the whole map. Iteration is in key order
+// within a shard, shard after shard, not in key order overall. K needs
+// a qHash() overload besides operator<
+template <class K, class V>
+class ShardedMap {
+public:
+    static constexpr int ShardBits = 6;
+    static constexpr int ShardCount = 1 << ShardBits;
+
+    using Shard = QMap<K, V>;
+
+    class const_iterator {
+    public:
+        const_iterator() = default;
+
+        const K & key() const { return current.key(); }
+        const V & value() const { return current.value(); }
+        const V & operator*() const { return current.value(); }
+        const V * operator->() const { return &current.value(); }
+
+        const_iterator & operator++() {
+            ++current;
+            settle();
+            return *this;
+        }
+
+        bool operator==(const const_iterator & other) const {
+            return (index == other.index && (index == ShardCount || current == other.current));
+        }
+        bool operator!=(const const_iterator & other) const { return !(*this == other); }
+
+    private:
+        friend class ShardedMap;
+
+        const_iterator(const ShardedMap * owner, int shard, typename Shard::const_iterator position) :
+            map(owner), index(shard), current(position)
+        {
+            settle();
+        }
+
+        // Skips over the ends of exhausted shards
+        void settle() {
+            while (index < ShardCount && current == map->shards[index].constEnd()) {
+                if (++index < ShardCount) {
+                    current = map->shards[index].constBegin();
+                }
+            }
+        }
+
+        const ShardedMap * map = nullptr;
+        int index = ShardCount;
+        typename Shard::const_iterator current;
+    };
+
+public:
+    inline int size() const;
+    inline bool isEmpty() const;
+    inline bool contains(const K & key) const;
+    inline V value(const K & key, const V & defaultValue = V()) const;
+
+    inline void insert(const K & key, const V & value);
+    inline void append(const K & key, const V & value);
+    inline int remove(const K & key);
+    inline V take(const K & key);
+    inline void clear();
+
+    inline QList<K> keys() const;
+    inline QList<V> values() const;
+
+    inline const_iterator constFind(const K & key) const;
+    inline const_iterator constBegin() const;
+    inline const_iterator constEnd() const;
+
+    static inline int shardOf(const K & key);
+    inline const Shard & shard(int index) const;
+
+    // Drops this copy's reference to a shard, a writer then no longer
+    // has to copy it to modify the shard
+    inline void release(int index);
+
+private:
+    std::array<Shard, ShardCount> shards;
+    int count = 0;
+};
+
+template<class K, class V>
+int ShardedMap<K, V>::size() const
+{
+    return count;
+}
+
+template<class K, class V>
+bool ShardedMap<K, V>::isEmpty() const
+{
+    return (count == 0);
+}
+
+template<class K, class V>
+bool ShardedMap<K, V>::contains(const K & key) const
+{
+    return shards[shardOf(key)].contains(key);
+}
+
+template<class K, class V>
+V ShardedMap<K, V>::value(const K & key, const V & defaultValue) const
+{
+    return shards[shardOf(key)].value(key, defaultValue);
+}
+
+template<class K, class V>
+void ShardedMap<K, V>::insert(const K & key, const V & value)
+{
+    auto & target = shards[shardOf(key)];
+    const int before = target.size();
+    target.insert(key, value);
+    count += target.size() - before;
+}
+
+template<class K, class V>
+void ShardedMap<K, V>::append(const K & key, const V & value)
+{
+    // Keys arriving in key order per shard go in without a lookup
+    auto & target = shards[shardOf(key)];
+    const int before = target.size();
+    target.insert(target.constEnd(), key, value);
+    count += target.size() - before;
+}
+
+template<class K, class V>
+int ShardedMap<K, V>::remove(const K & key)
+{
+    const int removed = shards[shardOf(key)].remove(key);
+    count -= removed;
+    return removed;
+}
+
+template<class K, class V>
+V ShardedMap<K, V>::take(const K & key)
+{
+    auto & target = shards[shardOf(key)];
+    const int before = target.size();
+    V result = target.take(key);
+    count -= before - target.size();
+    return result;
+}
+
+template<class K, class V>
+void ShardedMap<K, V>::clear()
+{
+    for (auto & target : shards) {
+        target.clear();
+    }
+    count = 0;
+}
+
+template<class K, class V>
+QList<K> ShardedMap<K, V>::keys() const
+{
+    QList<K> result;
+    result.reserve(count);
+    for (const auto & target : shards) {
+        for (auto it = target.constBegin(); it != target.constEnd(); ++it) {
+            result.append(it.key());
+        }
+    }
+    return result;
+}
+
+template<class K, class V>
+QList<V> ShardedMap<K, V>::values() const
+{
+    QList<V> result;
+    result.reserve(count);
+    for (const auto & target : shards) {
+        for (auto it = target.constBegin(); it != target.constEnd(); ++it) {
+            result.append(it.value());
+        }
+    }
+    return result;
+}
+
+template<class K, class V>
+typename ShardedMap<K, V>::const_iterator ShardedMap<K, V>::constFind(const K & key) const
+{
+    const int index = shardOf(key);
+    const auto it = shards[index].constFind(key);
+    if (it == shards[index].constEnd()) {
+        return constEnd();
+    }
+    return const_iterator(this, index, it);
+}
+
+template<class K, class V>
+typename ShardedMap<K, V>::const_iterator ShardedMap<K, V>::constBegin() const
+{
+    return const_iterator(this, 0, shards[0].constBegin());
+}
+
+template<class K, class V>
+typename ShardedMap<K, V>::const_iterator ShardedMap<K, V>::constEnd() const
+{
+    return const_iterator();
+}
+
+template<class K, class V>
+int ShardedMap<K, V>::shardOf(const K & key)
+{
+    // Fibonacci hashing spreads keys whose qHash is sequential, like ints
+    const quint32 hash = quint32(qHash(key));
+    return int((hash * 2654435769u) >> (32 - ShardBits));
+}
+
+template<class K, class V>
+const typename ShardedMap<K, V>::Shard & ShardedMap<K, V>::shard(int index) const
+{
+    return shards[index];
+}
+
+template<class K, class V>
+void ShardedMap<K, V>::release(int index)
+{
+    count -= shards[index].size();
+    shards[index] = Shard();
+}
+
+}
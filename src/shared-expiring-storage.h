@@ -0,0 +1,439 @@
+#pragma once
+
+#include <QByteArray>
+#include <QDataStream>
+#include <QDateTime>
+#include <QSharedMemory>
+#include <QString>
+#include <cstring>
+#include <limits>
+
+
+namespace qtstorage {
+
+// Fixed-capacity hash table in a shared memory segment: serialized entries
+// live in fixed-size slots addressed by index, and any attached process
+// reclaims expired entries it comes across
+template <class K, class V>
+class SharedExpiringStorage {
+public:
+    inline explicit SharedExpiringStorage(const QString & key);
+
+    inline bool create(int capacity, int payloadBytes = 256);
+    inline bool attach();
+    inline bool detach();
+    inline bool isAttached() const;
+
+    inline bool insert(const K & key,
+                       const V & value,
+                       qint64 lifetimeMsec = 0);
+
+    inline bool remove(const K & key);
+    inline V value(const K & key, const V & defaultValue = V());
+
+    inline bool contains(const K & key);
+    inline int size();
+    inline int capacity();
+    inline void clear();
+
+    inline int purgeExpired();
+
+private:
+    static constexpr quint32 SegmentMagic = 0x51545348;
+    static constexpr quint32 SegmentVersion = 1;
+
+    enum SlotState : quint32 {
+        Empty = 0,
+        Used = 1,
+        Deleted = 2
+    };
+
+    struct Header {
+        quint32 magic;
+        quint32 version;
+        quint32 capacity;
+        quint32 payloadBytes;
+        quint32 used;
+        quint32 deleted;
+    };
+
+    struct Slot {
+        quint32 state;
+        quint32 hash;
+        quint32 keySize;
+        quint32 valueSize;
+        qint64 deadline;
+    };
+
+    class SegmentLocker {
+    public:
+        explicit SegmentLocker(QSharedMemory * memory) : memory(memory) { memory->lock(); }
+        ~SegmentLocker() { memory->unlock(); }
+
+    private:
+        QSharedMemory * memory;
+    };
+
+    template<class T>
+    static inline QByteArray encode(const T & data);
+    template<class T>
+    static inline T decode(const char * data, int size);
+
+    static inline qint64 now();
+    static inline quint32 hashOf(const QByteArray & key);
+    static inline int slotStride(int payloadBytes);
+
+    inline Header * header();
+    inline Slot * slot(quint32 index);
+    inline char * payload(Slot * slot);
+
+    inline int find(const QByteArray & key, quint32 hash, qint64 current);
+    inline bool store(const QByteArray & key, const QByteArray & value, qint64 deadline);
+    inline void release(Slot * slot);
+    inline void rebuild();
+    inline void reset();
+
+private:
+    QSharedMemory memory;
+};
+
+template<class K, class V>
+SharedExpiringStorage<K, V>::SharedExpiringStorage(const QString & key) :
+    memory(key)
+{}
+
+template<class K, class V>
+bool SharedExpiringStorage<K, V>::create(int capacity, int payloadBytes)
+{
+    if (capacity <= 0 || payloadBytes <= 0) {
+        return false;
+    }
+
+    const qint64 size = qint64(sizeof(Header)) + qint64(capacity) * slotStride(payloadBytes);
+    if (size > std::numeric_limits<int>::max()) {
+        return false;
+    }
+
+    if (!memory.create(int(size))) {
+        return (memory.error() == QSharedMemory::AlreadyExists && attach());
+    }
+
+    SegmentLocker locker(&memory);
+    auto * segment = header();
+    segment->magic = SegmentMagic;
+    segment->version = SegmentVersion;
+    segment->capacity = quint32(capacity);
+    segment->payloadBytes = quint32(payloadBytes);
+    reset();
+    return true;
+}
+
+template<class K, class V>
+bool SharedExpiringStorage<K, V>::attach()
+{
+    if (!memory.isAttached() && !memory.attach()) {
+        return false;
+    }
+
+    SegmentLocker locker(&memory);
+    const auto * segment = header();
+    return (segment->magic == SegmentMagic && segment->version == SegmentVersion);
+}
+
+template<class K, class V>
+bool SharedExpiringStorage<K, V>::detach()
+{
+    return memory.detach();
+}
+
+template<class K, class V>
+bool SharedExpiringStorage<K, V>::isAttached() const
+{
+    return memory.isAttached();
+}
+
+template<class K, class V>
+bool SharedExpiringStorage<K, V>::insert(const K & key,
+                                         const V & value,
+                                         qint64 lifetimeMsec)
+{
+    const QByteArray keyData = encode(key);
+    const QByteArray valueData = encode(value);
+    const qint64 deadline = (lifetimeMsec > 0) ? now() + lifetimeMsec : 0;
+
+    SegmentLocker locker(&memory);
+    if (quint32(keyData.size() + valueData.size()) > header()->payloadBytes) {
+        return false;
+    }
+
+    // Tombstones lengthen every probe chain that crosses them
+    if (header()->deleted > header()->capacity / 4) {
+        rebuild();
+    }
+
+    if (store(keyData, valueData, deadline)) {
+        return true;
+    }
+
+    // Full: expired entries not yet reached by any probe still hold slots
+    rebuild();
+    return store(keyData, valueData, deadline);
+}
+
+template<class K, class V>
+bool SharedExpiringStorage<K, V>::remove(const K & key)
+{
+    const QByteArray keyData = encode(key);
+
+    SegmentLocker locker(&memory);
+    const int index = find(keyData, hashOf(keyData), now());
+    if (index < 0) {
+        return false;
+    }
+
+    release(slot(quint32(index)));
+    return true;
+}
+
+template<class K, class V>
+V SharedExpiringStorage<K, V>::value(const K & key, const V & defaultValue)
+{
+    const QByteArray keyData = encode(key);
+
+    SegmentLocker locker(&memory);
+    const int index = find(keyData, hashOf(keyData), now());
+    if (index < 0) {
+        return defaultValue;
+    }
+
+    auto * entry = slot(quint32(index));
+    return decode<V>(payload(entry) + entry->keySize, int(entry->valueSize));
+}
+
+template<class K, class V>
+bool SharedExpiringStorage<K, V>::contains(const K & key)
+{
+    const QByteArray keyData = encode(key);
+
+    SegmentLocker locker(&memory);
+    return (find(keyData, hashOf(keyData), now()) >= 0);
+}
+
+template<class K, class V>
+int SharedExpiringStorage<K, V>::size()
+{
+    SegmentLocker locker(&memory);
+    return int(header()->used);
+}
+
+template<class K, class V>
+int SharedExpiringStorage<K, V>::capacity()
+{
+    SegmentLocker locker(&memory);
+    return int(header()->capacity);
+}
+
+template<class K, class V>
+void SharedExpiringStorage<K, V>::clear()
+{
+    SegmentLocker locker(&memory);
+    reset();
+}
+
+template<class K, class V>
+int SharedExpiringStorage<K, V>::purgeExpired()
+{
+    SegmentLocker locker(&memory);
+
+    const qint64 current = now();
+    const quint32 count = header()->capacity;
+    int purged = 0;
+
+    for (quint32 i = 0; i < count; ++i) {
+        auto * entry = slot(i);
+        if (entry->state == Used && entry->deadline > 0 && entry->deadline <= current) {
+            release(entry);
+            ++purged;
+        }
+    }
+
+    return purged;
+}
+
+template<class K, class V>
+template<class T>
+QByteArray SharedExpiringStorage<K, V>::encode(const T & data)
+{
+    QByteArray encoded;
+    QDataStream stream(&encoded, QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_5_6);
+
+    stream << data;
+    return encoded;
+}
+
+template<class K, class V>
+template<class T>
+T SharedExpiringStorage<K, V>::decode(const char * data, int size)
+{
+    QDataStream stream(QByteArray(data, size));
+    stream.setVersion(QDataStream::Qt_5_6);
+
+    T decoded;
+    stream >> decoded;
+    return decoded;
+}
+
+template<class K, class V>
+qint64 SharedExpiringStorage<K, V>::now()
+{
+    return QDateTime::currentMSecsSinceEpoch();
+}
+
+template<class K, class V>
+quint32 SharedExpiringStorage<K, V>::hashOf(const QByteArray & key)
+{
+    // Explicit zero seed keeps the hash identical in every process
+    return quint32(qHash(key, 0));
+}
+
+template<class K, class V>
+int SharedExpiringStorage<K, V>::slotStride(int payloadBytes)
+{
+    const int stride = int(sizeof(Slot)) + payloadBytes;
+    return (stride + 7) & ~7;
+}
+
+template<class K, class V>
+typename SharedExpiringStorage<K, V>::Header * SharedExpiringStorage<K, V>::header()
+{
+    return static_cast<Header *>(memory.data());
+}
+
+template<class K, class V>
+typename SharedExpiringStorage<K, V>::Slot * SharedExpiringStorage<K, V>::slot(quint32 index)
+{
+    auto * base = static_cast<char *>(memory.data()) + sizeof(Header);
+    return reinterpret_cast<Slot *>(base + qint64(index) * slotStride(int(header()->payloadBytes)));
+}
+
+template<class K, class V>
+char * SharedExpiringStorage<K, V>::payload(Slot * slot)
+{
+    return reinterpret_cast<char *>(slot) + sizeof(Slot);
+}
+
+template<class K, class V>
+int SharedExpiringStorage<K, V>::find(const QByteArray & key, quint32 hash, qint64 current)
+{
+    const quint32 count = header()->capacity;
+
+    for (quint32 probe = 0; probe < count; ++probe) {
+        const quint32 index = (hash % count + probe) % count;
+        auto * entry = slot(index);
+
+        if (entry->state == Empty) {
+            return -1;
+        }
+        if (entry->state != Used) {
+            continue;
+        }
+
+        if (entry->deadline > 0 && entry->deadline <= current) {
+            release(entry);
+            continue;
+        }
+
+        if (entry->hash == hash
+                && entry->keySize == quint32(key.size())
+                && std::memcmp(payload(entry), key.constData(), size_t(key.size())) == 0) {
+            return int(index);
+        }
+    }
+
+    return -1;
+}
+
+template<class K, class V>
+bool SharedExpiringStorage<K, V>::store(const QByteArray & key,
+                                        const QByteArray & value,
+                                        qint64 deadline)
+{
+    const quint32 hash = hashOf(key);
+    const qint64 current = now();
+
+    int target = find(key, hash, current);
+    if (target < 0) {
+        const quint32 count = header()->capacity;
+        for (quint32 probe = 0; probe < count && target < 0; ++probe) {
+            const quint32 index = (hash % count + probe) % count;
+            if (slot(index)->state != Used) {
+                target = int(index);
+            }
+        }
+
+        if (target < 0) {
+            return false;
+        }
+
+        auto * entry = slot(quint32(target));
+        if (entry->state == Deleted) {
+            header()->deleted -= 1;
+        }
+        header()->used += 1;
+    }
+
+    auto * entry = slot(quint32(target));
+    entry->state = Used;
+    entry->hash = hash;
+    entry->keySize = quint32(key.size());
+    entry->valueSize = quint32(value.size());
+    entry->deadline = deadline;
+
+    std::memcpy(payload(entry), key.constData(), size_t(key.size()));
+    std::memcpy(payload(entry) + key.size(), value.constData(), size_t(value.size()));
+    return true;
+}
+
+template<class K, class V>
+void SharedExpiringStorage<K, V>::release(Slot * slot)
+{
+    slot->state = Deleted;
+    header()->used -= 1;
+    header()->deleted += 1;
+}
+
+template<class K, class V>
+void SharedExpiringStorage<K, V>::rebuild()
+{
+    const quint32 count = header()->capacity;
+    const int stride = slotStride(int(header()->payloadBytes));
+    const qint64 current = now();
+
+    const QByteArray copy(reinterpret_cast<const char *>(slot(0)), int(count) * stride);
+    reset();
+
+    for (quint32 i = 0; i < count; ++i) {
+        const auto * entry = reinterpret_cast<const Slot *>(copy.constData() + qint64(i) * stride);
+        if (entry->state != Used || (entry->deadline > 0 && entry->deadline <= current)) {
+            continue;
+        }
+
+        const char * data = reinterpret_cast<const char *>(entry) + sizeof(Slot);
+        store(QByteArray(data, int(entry->keySize)),
+              QByteArray(data + entry->keySize, int(entry->valueSize)),
+              entry->deadline);
+    }
+}
+
+template<class K, class V>
+void SharedExpiringStorage<K, V>::reset()
+{
+    auto * segment = header();
+    std::memset(slot(0), 0, size_t(segment->capacity) * size_t(slotStride(int(segment->payloadBytes))));
+
+    segment->used = 0;
+    segment->deleted = 0;
+}
+
+}
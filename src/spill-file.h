@@ -0,0 +1,193 @@
+#pragma once
+
+#include <QByteArray>
+#include <QDir>
+#include <QList>
+#include <QMutex>
+#include <QSharedPointer>
+#include <QString>
+#include <QTemporaryFile>
+
+
+namespace qtstorage {
+
+class SpillSegment {
+public:
+    inline explicit SpillSegment(const QString & directory);
+
+    inline bool open();
+    inline qint64 append(const QByteArray & bytes);
+    // Fails on a seek error or a short read
+    inline bool read(qint64 offset, int length, QByteArray * bytes);
+    inline void release(int length);
+
+    inline qint64 size();
+    inline qint64 liveBytes();
+
+private:
+    QTemporaryFile file;
+    QMutex mtx;
+    qint64 end = 0;
+    qint64 live = 0;
+    bool dirty = false;
+};
+
+class SpillFile {
+public:
+    struct Location {
+        QSharedPointer<SpillSegment> segment;
+        qint64 offset = 0;
+        int length = 0;
+    };
+
+public:
+    inline explicit SpillFile(const QString & directory,
+                              qint64 segmentBytes = 64 * 1024 * 1024);
+
+    inline bool append(const QByteArray & bytes, Location * location);
+    inline bool read(const Location & location, QByteArray * bytes) const;
+    inline void release(const Location & location);
+
+    inline QList<QSharedPointer<SpillSegment>> sparseSegments(double maxLiveRatio);
+    inline void retire(const QSharedPointer<SpillSegment> & segment);
+    inline bool takeRollover();
+
+private:
+    const QString directory;
+    const qint64 segmentBytes;
+
+    QSharedPointer<SpillSegment> active;
+    QList<QSharedPointer<SpillSegment>> sealed;
+    bool rolledOver = false;
+};
+
+SpillSegment::SpillSegment(const QString & directory) :
+    file(QDir(directory).filePath(QStringLiteral("spill-XXXXXX.seg")))
+{}
+
+bool SpillSegment::open()
+{
+    return file.open();
+}
+
+qint64 SpillSegment::append(const QByteArray & bytes)
+{
+    QMutexLocker locker(&mtx);
+
+    const qint64 offset = end;
+    if (!file.seek(offset) || file.write(bytes) != bytes.size()) {
+        return -1;
+    }
+
+    end += bytes.size();
+    live += bytes.size();
+    dirty = true;
+    return offset;
+}
+
+bool SpillSegment::read(qint64 offset, int length, QByteArray * bytes)
+{
+    QMutexLocker locker(&mtx);
+
+    if (dirty) {
+        file.flush();
+        dirty = false;
+    }
+
+    if (!file.seek(offset)) {
+        return false;
+    }
+
+    *bytes = file.read(length);
+    return (bytes->size() == length);
+}
+
+void SpillSegment::release(int length)
+{
+    QMutexLocker locker(&mtx);
+    live -= length;
+}
+
+qint64 SpillSegment::size()
+{
+    QMutexLocker locker(&mtx);
+    return end;
+}
+
+qint64 SpillSegment::liveBytes()
+{
+    QMutexLocker locker(&mtx);
+    return live;
+}
+
+SpillFile::SpillFile(const QString & directory, qint64 segmentBytes) :
+    directory(directory),
+    segmentBytes(segmentBytes)
+{}
+
+bool SpillFile::append(const QByteArray & bytes, Location * location)
+{
+    if (active && active->size() + bytes.size() > segmentBytes) {
+        sealed.append(active);
+        active.clear();
+        rolledOver = true;
+    }
+
+    if (!active) {
+        auto segment = QSharedPointer<SpillSegment>::create(directory);
+        if (!segment->open()) {
+            return false;
+        }
+        active = segment;
+    }
+
+    const qint64 offset = active->append(bytes);
+    if (offset < 0) {
+        return false;
+    }
+
+    location->segment = active;
+    location->offset = offset;
+    location->length = bytes.size();
+    return true;
+}
+
+bool SpillFile::read(const Location & location, QByteArray * bytes) const
+{
+    return location.segment->read(location.offset, location.length, bytes);
+}
+
+void SpillFile::release(const Location & location)
+{
+    location.segment->release(location.length);
+
+    if (location.segment != active && location.segment->liveBytes() == 0) {
+        retire(location.segment);
+    }
+}
+
+QList<QSharedPointer<SpillSegment>> SpillFile::sparseSegments(double maxLiveRatio)
+{
+    QList<QSharedPointer<SpillSegment>> result;
+    for (const auto & segment : sealed) {
+        if (segment->liveBytes() < qint64(double(segment->size()) * maxLiveRatio)) {
+            result.append(segment);
+        }
+    }
+    return result;
+}
+
+void SpillFile::retire(const QSharedPointer<SpillSegment> & segment)
+{
+    // The file itself goes away with the last Location referring to it
+    sealed.removeOne(segment);
+}
+
+bool SpillFile::takeRollover()
+{
+    const bool result = rolledOver;
+    rolledOver = false;
+    return result;
+}
+
+}
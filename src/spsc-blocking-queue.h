@@ -0,0 +1,153 @@
+#pragma once
+
+#include <QMutex>
+#include <QWaitCondition>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+#include "detail/wait.h"
+
+
+namespace qtstorage {
+
+// Single producer, single consumer ring buffer with the BlockingQueue
+// interface: each side owns one index and keeps a cached copy of the
+// other one, so a handoff is a plain store and usually no shared load
+template <class T>
+class SpscBlockingQueue {
+public:
+    inline explicit SpscBlockingQueue(int capacity = 1024);
+
+    inline bool enqueue(const T & item, qint64 timeout = -1);
+    inline bool tryEnqueue(const T & item);
+    inline T dequeue(qint64 timeout = -1, bool * ok = nullptr);
+    inline int size() const;
+    inline int capacity() const;
+
+private:
+    static constexpr size_t CacheLine = 64;
+    static constexpr int SpinCount = 128;
+
+    inline bool push(const T & item);
+    inline bool pop(T * item);
+
+private:
+    const size_t mask;
+    std::unique_ptr<T[]> slots;
+
+    // Consumer side
+    alignas(CacheLine) std::atomic<size_t> head{0};
+    size_t tailCache = 0;
+
+    // Producer side
+    alignas(CacheLine) std::atomic<size_t> tail{0};
+    size_t headCache = 0;
+
+    // At most one waiter on either side
+    alignas(CacheLine) std::atomic<int> consumerWaiting{0};
+    std::atomic<int> producerWaiting{0};
+    QMutex mtx;
+    QWaitCondition notFull;
+    QWaitCondition notEmpty;
+};
+
+template<class T>
+SpscBlockingQueue<T>::SpscBlockingQueue(int capacity) :
+    mask(detail::roundUp(capacity) - 1),
+    slots(new T[mask + 1])
+{}
+
+template<class T>
+bool SpscBlockingQueue<T>::enqueue(const T & item, qint64 timeout)
+{
+    if (!push(item)) {
+        if (timeout == 0 || !detail::block(mtx, notFull, producerWaiting, timeout,
+                                           [&]() -> bool { return push(item); })) {
+            return false;
+        }
+    }
+
+    detail::wake(mtx, notEmpty, consumerWaiting);
+    return true;
+}
+
+template<class T>
+bool SpscBlockingQueue<T>::tryEnqueue(const T & item)
+{
+    return enqueue(item, 0);
+}
+
+template<class T>
+T SpscBlockingQueue<T>::dequeue(qint64 timeout, bool * ok)
+{
+    T item;
+    bool done = pop(&item);
+
+    // The producer is usually only a moment away, spinning a little
+    // is much cheaper than a sleep and a wakeup
+    for (int i = 0; !done && timeout != 0 && i < SpinCount; ++i) {
+        done = pop(&item);
+    }
+
+    if (!done) {
+        if (timeout == 0 || !detail::block(mtx, notEmpty, consumerWaiting, timeout,
+                                           [&]() -> bool { return pop(&item); })) {
+            if (ok) { *ok = false; }
+            return T();
+        }
+    }
+
+    detail::wake(mtx, notFull, producerWaiting);
+    if (ok) { *ok = true; }
+    return item;
+}
+
+template<class T>
+int SpscBlockingQueue<T>::size() const
+{
+    const size_t first = head.load(std::memory_order_acquire);
+    const size_t last = tail.load(std::memory_order_acquire);
+    return (last > first) ? int(last - first) : 0;
+}
+
+template<class T>
+int SpscBlockingQueue<T>::capacity() const
+{
+    return int(mask + 1);
+}
+
+template<class T>
+bool SpscBlockingQueue<T>::push(const T & item)
+{
+    const size_t position = tail.load(std::memory_order_relaxed);
+    if (position - headCache > mask) {
+        headCache = head.load(std::memory_order_acquire);
+        if (position - headCache > mask) {
+            return false;
+        }
+    }
+
+    slots[position & mask] = item;
+    tail.store(position + 1, std::memory_order_release);
+    return true;
+}
+
+template<class T>
+bool SpscBlockingQueue<T>::pop(T * item)
+{
+    const size_t position = head.load(std::memory_order_relaxed);
+    if (position == tailCache) {
+        tailCache = tail.load(std::memory_order_acquire);
+        if (position == tailCache) {
+            return false;
+        }
+    }
+
+    *item = std::move(slots[position & mask]);
+    slots[position & mask] = T();
+    head.store(position + 1, std::memory_order_release);
+    return true;
+}
+
+}